@@ -0,0 +1,331 @@
+/*
+ * Microbenchmarks of the library's inner loops. The library is included whole
+ * so that its static functions can be driven directly, without any audio
+ * devices or threads. Run with "make bench", or as
+ *
+ *	bench [-r REPS] [NAME...]
+ *
+ * to run only the benchmarks whose names start with one of the NAMEs. Each
+ * benchmark is first run until it takes at least MIN_RUN_TIME, which also warms
+ * up the caches and branch predictors, and is then timed over REPS runs of that
+ * many iterations. The fastest and the median run are reported.
+ */
+#include "libsofi/libsofi.c"
+
+#include <unistd.h>
+
+#define MIN_RUN_TIME 0.02 /* seconds */
+#define DEFAULT_REPS 9
+#define MAX_REPS 101
+
+/* Results go here so that the compiler can't drop the work. */
+static volatile float sink;
+
+struct benchmark {
+	const char *name;
+	/* Set up the globals the benchmark runs on; may be NULL. */
+	void (*setup)(const struct benchmark *b);
+	/* Do n iterations. */
+	void (*run)(unsigned long n);
+	/* Work per iteration, for the throughput, and its unit. */
+	double items;
+	const char *unit;
+	/* Argument to setup(). */
+	int arg;
+};
+
+/* Synthesis. */
+
+#define BENCH_RATE 48000L
+#define BENCH_BAUD 1200.f
+#define BENCH_FRAMES 1024 /* per callback */
+
+static struct raw_message bench_msg;
+static struct modem_params *bench_params = &param_blocks[0];
+static void *bench_output;
+
+/* A plan of 1 << width tones, 50 Hz apart from 1 kHz, at BENCH_RATE. */
+static void bench_plan(int width)
+{
+	struct modem_params *p = bench_params;
+
+	p->baud = BENCH_BAUD;
+	p->recv_window_factor = 0.1f;
+	p->interpacket_gap_factor = 15.f;
+	p->symbol_width = width;
+	p->rate_adaptation = false;
+	p->max_rung = BASE_RUNG;
+	p->rate = BENCH_RATE;
+	p->front_end = NULL;
+	for (int i = 0; i < num_symbols(p); i++) {
+		p->symbol_freqs[i] = 1000.f + 50.f * i;
+		p->tx_steps[i] = nco_step(p->symbol_freqs[i], BENCH_RATE);
+		p->rx_steps[i] = nco_step(p->symbol_freqs[i], BENCH_RATE);
+	}
+	active_params = 0;
+}
+
+/* A full packet of pseudo-random bytes and its CRC, as sofi_send() builds it. */
+static size_t bench_packet(unsigned char *buf)
+{
+	size_t size = sizeof(uint8_t) + UINT8_MAX;
+	uint32_t crc, x = 1;
+
+	buf[0] = UINT8_MAX;
+	for (size_t i = 1; i < size; i++) {
+		x = x * 1103515245 + 12345;
+		buf[i] = x >> 24;
+	}
+	crc = crc32(buf, size);
+	memcpy(buf + size, &crc, sizeof(crc));
+	return size + sizeof(crc);
+}
+
+static void setup_sender(const struct benchmark *b)
+{
+	unsigned char buf[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+
+	int16_samples = b->arg;
+	output_channels = 1;
+	output_rate = BENCH_RATE;
+	bench_plan(2);
+	encode_message(bench_params, &bench_msg, buf, bench_packet(buf),
+		       BASE_RUNG, false, false);
+	free(bench_output);
+	bench_output = calloc(BENCH_FRAMES, sizeof(float));
+	assert(bench_output);
+}
+
+static void run_sender(unsigned long n)
+{
+	struct sender_callback_data *s = &data.sender[0];
+
+	for (unsigned long i = 0; i < n; i++) {
+		/* Stay in the middle of a message. */
+		if (s->msg != &bench_msg || s->index > bench_msg.len / 2) {
+			s->state = SEND_STATE_TRANSMITTING;
+			s->params = bench_params;
+			s->msg = &bench_msg;
+			s->index = 0;
+			s->frame = 0;
+			s->symbol_frames = rung_symbol_frames(bench_params,
+							      BENCH_RATE, -1);
+		}
+		sender_callback(bench_output, BENCH_FRAMES, s, 0);
+	}
+	sink = int16_samples ? ((int16_t *)bench_output)[0] :
+			       ((float *)bench_output)[0];
+}
+
+/* Detection. */
+
+static float bench_channel_strengths[MAX_INPUT_CHANNELS][1 << 8];
+static float bench_strengths[1 << 8];
+static int bench_window;
+
+static void setup_detector(const struct benchmark *b)
+{
+	int width = b->arg & 0xf;
+	uint32_t x = 1;
+
+	int16_samples = b->arg >> 4;
+	input_channels = 1;
+	combining = SOFI_COMBINE_MRC;
+	reset_channels();
+	reset_tracker(&freq_tracker);
+	bench_plan(width);
+	bench_window = (int)rung_symbol_frames(bench_params, BENCH_RATE, -1);
+	free(window_buffer);
+	window_buffer = malloc(bench_window * frame_size());
+	assert(window_buffer);
+	for (int i = 0; i < bench_window; i++) {
+		float v = 0.5f * sinf(2.f * M_PI * bench_params->symbol_freqs[1] *
+				      i / BENCH_RATE);
+
+		x = x * 1103515245 + 12345;
+		v += 0.01f * ((float)(x >> 16) / 65536.f - 0.5f);
+		if (int16_samples)
+			((int16_t *)window_buffer)[i] = (int16_t)lrintf(v * 32767.f);
+		else
+			((float *)window_buffer)[i] = v;
+	}
+}
+
+static void run_detector(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++)
+		window_strengths(bench_params, 0, bench_window,
+				 bench_params->symbol_width,
+				 bench_channel_strengths, bench_strengths);
+	sink = bench_strengths[1];
+}
+
+/* Coding. */
+
+static unsigned char bench_buf[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+static size_t bench_size;
+static int bench_rung;
+
+static void setup_crc32(const struct benchmark *b)
+{
+	(void)b;
+	bench_size = bench_packet(bench_buf) - sizeof(uint32_t);
+}
+
+static void run_crc32(unsigned long n)
+{
+	uint32_t crc = 0;
+
+	for (unsigned long i = 0; i < n; i++)
+		crc ^= crc32(bench_buf, bench_size);
+	sink = (float)crc;
+}
+
+/* arg is the symbol width, or 0 for rung 0 of the default plan, with FEC. */
+static void setup_coding(const struct benchmark *b)
+{
+	hamming_init();
+	bench_plan(b->arg ? b->arg : 2);
+	bench_rung = b->arg ? BASE_RUNG : 0;
+	bench_size = bench_packet(bench_buf);
+	encode_message(bench_params, &bench_msg, bench_buf, bench_size,
+		       bench_rung, false, false);
+}
+
+static void run_pack(unsigned long n)
+{
+	for (unsigned long i = 0; i < n; i++)
+		encode_message(bench_params, &bench_msg, bench_buf, bench_size,
+			       bench_rung, false, false);
+	sink = bench_msg.symbols[bench_msg.len - 1];
+}
+
+static void run_unpack(unsigned long n)
+{
+	unsigned char buf[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+	unsigned int corrected;
+	int ret = 0;
+
+	for (unsigned long i = 0; i < n; i++)
+		ret |= decode_message(&bench_msg, buf, &corrected);
+	assert(ret == 0);
+	sink = buf[1];
+}
+
+/* Receive queue, uncontended. */
+
+static void run_recv_queue(unsigned long n)
+{
+	static struct raw_message msg;
+
+	for (unsigned long i = 0; i < n; i++) {
+		recv_queue_enqueue(&msg);
+		recv_queue_dequeue(&msg, INFINITY);
+	}
+	sink = msg.len;
+}
+
+static const struct benchmark benchmarks[] = {
+	{"sender/float", setup_sender, run_sender, BENCH_FRAMES, "frames", 0},
+	{"sender/int16", setup_sender, run_sender, BENCH_FRAMES, "frames", 1},
+	{"detector/float/w1", setup_detector, run_detector, 1, "windows", 0x01},
+	{"detector/float/w2", setup_detector, run_detector, 1, "windows", 0x02},
+	{"detector/float/w4", setup_detector, run_detector, 1, "windows", 0x04},
+	{"detector/float/w8", setup_detector, run_detector, 1, "windows", 0x08},
+	{"detector/int16/w1", setup_detector, run_detector, 1, "windows", 0x11},
+	{"detector/int16/w2", setup_detector, run_detector, 1, "windows", 0x12},
+	{"detector/int16/w4", setup_detector, run_detector, 1, "windows", 0x14},
+	{"detector/int16/w8", setup_detector, run_detector, 1, "windows", 0x18},
+	{"crc32", setup_crc32, run_crc32, sizeof(uint8_t) + UINT8_MAX, "bytes", 0},
+	{"pack/w1", setup_coding, run_pack, 1, "packets", 1},
+	{"pack/w2", setup_coding, run_pack, 1, "packets", 2},
+	{"pack/w4", setup_coding, run_pack, 1, "packets", 4},
+	{"pack/w8", setup_coding, run_pack, 1, "packets", 8},
+	{"pack/fec", setup_coding, run_pack, 1, "packets", 0},
+	{"unpack/w1", setup_coding, run_unpack, 1, "packets", 1},
+	{"unpack/w2", setup_coding, run_unpack, 1, "packets", 2},
+	{"unpack/w4", setup_coding, run_unpack, 1, "packets", 4},
+	{"unpack/w8", setup_coding, run_unpack, 1, "packets", 8},
+	{"unpack/fec", setup_coding, run_unpack, 1, "packets", 0},
+	{"recv_queue", NULL, run_recv_queue, 1, "messages", 0},
+};
+
+static double time_run(const struct benchmark *b, unsigned long n)
+{
+	double start = monotonic_time();
+
+	b->run(n);
+	return monotonic_time() - start;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void run_benchmark(const struct benchmark *b, int reps)
+{
+	double times[MAX_REPS];
+	unsigned long n = 1;
+	double best, median;
+
+	if (b->setup)
+		b->setup(b);
+	while (time_run(b, n) < MIN_RUN_TIME)
+		n *= 2;
+	for (int i = 0; i < reps; i++)
+		times[i] = time_run(b, n) / n;
+	qsort(times, reps, sizeof(times[0]), compare_doubles);
+	best = times[0];
+	median = times[reps / 2];
+	printf("%-20s %12.1f %12.1f %12.3f M%s/s\n", b->name, best * 1e9,
+	       median * 1e9, b->items / median / 1e6, b->unit);
+}
+
+static bool selected(const char *name, int argc, char **argv)
+{
+	if (argc == 0)
+		return true;
+	for (int i = 0; i < argc; i++) {
+		if (strncmp(name, argv[i], strlen(argv[i])) == 0)
+			return true;
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	int reps = DEFAULT_REPS;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:")) != -1) {
+		switch (opt) {
+		case 'r':
+			reps = atoi(optarg);
+			if (reps < 1 || reps > MAX_REPS) {
+				fprintf(stderr, "%s: reps must be from 1 to %d\n",
+					argv[0], MAX_REPS);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r REPS] [NAME...]\n",
+				argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	sine_init();
+	hamming_init();
+	printf("%-20s %12s %12s %16s\n", "benchmark", "best ns/op",
+	       "median ns/op", "throughput");
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+		if (selected(benchmarks[i].name, argc - optind, argv + optind))
+			run_benchmark(&benchmarks[i], reps);
+	}
+	free(bench_output);
+	free(window_buffer);
+	return EXIT_SUCCESS;
+}
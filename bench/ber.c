@@ -0,0 +1,594 @@
+/*
+ * Bit and packet error rates against SNR. Random packets are modulated by the
+ * sender's callback, go through a channel that adds white Gaussian noise, and
+ * are demodulated by the receiver thread, all without audio devices and as fast
+ * as the receiver can keep up. Every combination of the swept parameters is run
+ * and reported as a line of CSV on stdout, under a header naming the columns.
+ *
+ * The SNR is the power of the tones over the power of the noise across the
+ * whole band up to half of --rate, and ebn0_db is the same converted to energy
+ * per bit over the noise density. The bit error rate is over the packets that
+ * were heard at all, CRC failures included; the packet error rate counts the
+ * ones that were never heard too. Goodput is the payload delivered intact over
+ * the air time of the packets and their gaps.
+ *
+ * The tones of a plan are spaced --spacing apart starting from --spacing, the
+ * baud by default, and plans that don't fit under --rate are skipped.
+ *
+ * The payloads and the noise are the same on every run with the same --seed,
+ * but the receiver thread sees the audio in whatever pieces have arrived when it
+ * wakes up, so counts near the noise floor, spurious detections especially, can
+ * differ by one or two between runs.
+ */
+#include "libsofi/libsofi.c"
+
+#include <getopt.h>
+
+#define MAX_SWEEP 64
+#define CHUNK_FRAMES 256
+#define LEAD_IN 0.05 /* seconds of noise before the first packet */
+#define HEADROOM 0.25f /* channel gain, so that int16 noise rarely clips */
+/*
+ * Seconds of audio that the channel may run ahead of the receiver. Any more
+ * and the receiver could finish more packets at a time than the receive queue
+ * holds.
+ */
+#define MAX_AHEAD 0.1
+
+static const char *progname = "ber";
+
+/* Options. */
+static float snrs[MAX_SWEEP] = {10.f, 12.f, 14.f, 16.f, 18.f, 20.f, 25.f};
+static float bauds[MAX_SWEEP] = {1200.f};
+static float widths[MAX_SWEEP] = {1.f, 2.f};
+static float gaps[MAX_SWEEP] = {15.f};
+static int num_snrs = 7, num_bauds = 1, num_widths = 2, num_gaps = 1;
+static unsigned long num_packets = 100;
+static int payload_length = 32;
+static long sim_rate = 48000;
+static float spacing;
+static enum sofi_sample_format sample_format = SOFI_SAMPLE_FLOAT32;
+static uint32_t seed = 1;
+static int debug;
+/* Fail if any point's packet error rate is above this. */
+static float max_per = 1.f;
+
+struct result {
+	/* Packets delivered intact, heard with a bad CRC, and never heard. */
+	unsigned long ok, corrupt, missed;
+	/* Detections that couldn't be matched to any packet. */
+	unsigned long spurious;
+	unsigned long bit_errors, bits;
+	/* Frames from the start of the first packet to the end of the last gap. */
+	unsigned long air_frames;
+};
+
+enum packet_status {
+	PACKET_MISSED,
+	PACKET_CORRUPT,
+	PACKET_OK,
+};
+
+/* Per-run state. */
+static enum packet_status *status;
+static unsigned int *bit_errors;
+static unsigned long packets_queued, next_expected;
+static uint32_t noise_state;
+static float noise_sigma;
+static void *tx_chunk, *rx_chunk;
+
+static uint32_t xorshift32(uint32_t *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 17;
+	*x ^= *x << 5;
+	return *x;
+}
+
+static float gaussian(void)
+{
+	float u1, u2;
+
+	do {
+		u1 = (xorshift32(&noise_state) >> 8) / 16777216.f;
+	} while (u1 == 0.f);
+	u2 = (xorshift32(&noise_state) >> 8) / 16777216.f;
+	return sqrtf(-2.f * logf(u1)) * cosf(2.f * M_PI * u2);
+}
+
+/*
+ * The packet with sequence number seq as sofi_send() frames it: length,
+ * payload, and CRC. The payload starts with the sequence number.
+ */
+static size_t make_packet(unsigned long seq, unsigned char *buf)
+{
+	size_t size = sizeof(uint8_t) + payload_length;
+	uint32_t x = (seed * UINT32_C(2654435761)) ^ (uint32_t)(seq + 1);
+	uint32_t s = (uint32_t)seq, crc;
+
+	buf[0] = payload_length;
+	memcpy(buf + 1, &s, sizeof(s));
+	for (size_t i = 1 + sizeof(s); i < size; i++)
+		buf[i] = xorshift32(&x) >> 24;
+	crc = crc32(buf, size);
+	memcpy(buf + size, &crc, sizeof(crc));
+	return size + sizeof(crc);
+}
+
+static unsigned int count_bits(unsigned char c)
+{
+	unsigned int n = 0;
+
+	for (; c; c >>= 1)
+		n += c & 1;
+	return n;
+}
+
+/* Match a message from the receiver to the packet it most likely was. */
+static void account(const struct raw_message *msg, struct result *r)
+{
+	unsigned char buf[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+	unsigned char sent[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+	unsigned int corrected;
+	unsigned long seq;
+	uint32_t s;
+	size_t size;
+	bool ok;
+
+	ok = decode_message(msg, buf, &corrected) == 0;
+	memcpy(&s, buf + 1, sizeof(s));
+	seq = s;
+	/*
+	 * A corrupt sequence number is most likely the next packet's. Once a
+	 * packet is matched, only an intact copy can take its place.
+	 */
+	if (!ok && (seq >= packets_queued || status[seq] != PACKET_MISSED))
+		seq = next_expected;
+	if (seq >= packets_queued || status[seq] == PACKET_OK ||
+	    (!ok && status[seq] == PACKET_CORRUPT)) {
+		r->spurious++;
+		return;
+	}
+	size = make_packet(seq, sent);
+	bit_errors[seq] = 0;
+	if (!ok) {
+		for (size_t i = 0; i < size; i++)
+			bit_errors[seq] += count_bits(buf[i] ^ sent[i]);
+	}
+	status[seq] = ok ? PACKET_OK : PACKET_CORRUPT;
+	next_expected = seq + 1;
+}
+
+/* Take whatever the receiver has queued without waiting. */
+static void drain_queue(struct result *r)
+{
+	struct raw_message msg;
+	int ret;
+
+	for (;;) {
+		ret = pthread_mutex_lock(&recv_queue_lock);
+		assert(ret == 0);
+		if (!recv_queue_size) {
+			ret = pthread_mutex_unlock(&recv_queue_lock);
+			assert(ret == 0);
+			return;
+		}
+		memcpy(&msg, &recv_queue[recv_queue_start], sizeof(msg));
+		recv_queue_start = (recv_queue_start + 1) % RECV_QUEUE_CAP;
+		recv_queue_size--;
+		ret = pthread_mutex_unlock(&recv_queue_lock);
+		assert(ret == 0);
+		account(&msg, r);
+	}
+}
+
+/*
+ * Run frames of the sender's output, or silence if it is NULL, through the
+ * channel into the capture ring, waiting for the receiver to catch up first.
+ */
+static void channel(const void *tx, unsigned long frames, struct result *r)
+{
+	PaUtilRingBuffer *capture = &data.receiver.buffer;
+
+	while (PaUtil_GetRingBufferReadAvailable(capture) > MAX_AHEAD * sim_rate) {
+		drain_queue(r);
+		Pa_Sleep(1);
+	}
+	for (unsigned long i = 0; i < frames; i++) {
+		float x = 0.f, y;
+
+		if (tx && int16_samples)
+			x = ((const int16_t *)tx)[i] / 32768.f;
+		else if (tx)
+			x = ((const float *)tx)[i];
+		y = HEADROOM * (x + noise_sigma * gaussian());
+		if (int16_samples) {
+			y = fmaxf(fminf(y, 1.f), -1.f);
+			((int16_t *)rx_chunk)[i] = (int16_t)lrintf(y * 32767.f);
+		} else {
+			((float *)rx_chunk)[i] = y;
+		}
+	}
+	PaUtil_WriteRingBuffer(capture, rx_chunk, frames);
+	advance_capture_clock(frames, monotonic_time());
+}
+
+static void channel_silence(double seconds, struct result *r)
+{
+	unsigned long frames = (unsigned long)(seconds * sim_rate);
+
+	while (frames) {
+		unsigned long n = frames < CHUNK_FRAMES ? frames : CHUNK_FRAMES;
+
+		channel(NULL, n, r);
+		frames -= n;
+	}
+}
+
+/* Wait until the receiver has gone through everything it was given. */
+static void wait_receiver(struct result *r)
+{
+	ring_buffer_size_t capture, modem;
+
+	do {
+		capture = PaUtil_GetRingBufferReadAvailable(&data.receiver.buffer);
+		modem = PaUtil_GetRingBufferReadAvailable(&modem_buffer);
+		drain_queue(r);
+		Pa_Sleep(1);
+	} while (capture ||
+		 modem != PaUtil_GetRingBufferReadAvailable(&modem_buffer));
+	drain_queue(r);
+}
+
+static void send_packets(const struct modem_params *p, struct result *r)
+{
+	struct sender_callback_data *s = &data.sender[0];
+	unsigned char buf[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+	struct raw_message msg;
+
+	for (;;) {
+		/* Keep the sender's queue full, as sofi_send() would. */
+		while (packets_queued < num_packets &&
+		       PaUtil_GetRingBufferWriteAvailable(&s->buffer)) {
+			encode_message(p, &msg, buf,
+				       make_packet(packets_queued, buf),
+				       BASE_RUNG, false, false);
+			msg.timestamp = monotonic_time();
+			PaUtil_WriteRingBuffer(&s->buffer, &msg, 1);
+			packets_queued++;
+		}
+		if (packets_queued == num_packets && s->state == SEND_STATE_IDLE &&
+		    !PaUtil_GetRingBufferReadAvailable(&s->buffer))
+			break;
+		memset(tx_chunk, 0, CHUNK_FRAMES * sample_size());
+		output_dac_time = monotonic_time();
+		sender_callback(tx_chunk, CHUNK_FRAMES, s, 0);
+		channel(tx_chunk, CHUNK_FRAMES, r);
+		r->air_frames += CHUNK_FRAMES;
+		drain_queue(r);
+	}
+}
+
+/*
+ * Run one point of the sweep.
+ *
+ * Return: 0 on success, -1 if the plan doesn't fit or on error.
+ */
+static int simulate(const struct sofi_init_parameters *params, float snr,
+		    struct result *r)
+{
+	const struct modem_params *p = &param_blocks[0];
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	if (init_state(params))
+		return -1;
+	input_rate = output_rate = sim_rate;
+	if (check_freqs(params))
+		goto err;
+	active_params = 0;
+	if (set_params(&param_blocks[0], params))
+		goto err;
+	receiver_params = p;
+	recv_queue_start = recv_queue_size = 0;
+
+	status = calloc(num_packets, sizeof(*status));
+	bit_errors = calloc(num_packets, sizeof(*bit_errors));
+	tx_chunk = malloc(CHUNK_FRAMES * sample_size());
+	rx_chunk = malloc(CHUNK_FRAMES * sample_size());
+	if (!status || !bit_errors || !tx_chunk || !rx_chunk) {
+		perror("malloc");
+		goto free;
+	}
+	packets_queued = next_expected = 0;
+	noise_state = seed * UINT32_C(2246822519) | 1;
+	/* A full-scale sine has a power of 1/2. */
+	noise_sigma = sqrtf(0.5f / powf(10.f, snr / 10.f));
+
+	if (trace_ring_init(&receiver_trace))
+		goto free;
+	ret = pthread_create(&receiver_thread, NULL, receiver_loop,
+			     &data.receiver.buffer);
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		trace_ring_free(&receiver_trace);
+		goto free;
+	}
+
+	channel_silence(LEAD_IN, r);
+	send_packets(p, r);
+	channel_silence(LEAD_IN, r);
+	wait_receiver(r);
+
+	ret = pthread_cancel(receiver_thread);
+	assert(ret == 0);
+	ret = pthread_join(receiver_thread, NULL);
+	assert(ret == 0);
+	trace_drain(&receiver_trace, stderr);
+	trace_ring_free(&receiver_trace);
+	drain_queue(r);
+	for (unsigned long i = 0; i < num_packets; i++) {
+		if (status[i] == PACKET_MISSED) {
+			r->missed++;
+			continue;
+		}
+		if (status[i] == PACKET_OK)
+			r->ok++;
+		else
+			r->corrupt++;
+		r->bit_errors += bit_errors[i];
+		r->bits += (sizeof(uint8_t) + payload_length +
+			    sizeof(uint32_t)) * CHAR_BIT;
+	}
+
+	free(status);
+	free(bit_errors);
+	free(tx_chunk);
+	free(rx_chunk);
+	free_state();
+	return 0;
+
+free:
+	free(status);
+	free(bit_errors);
+	free(tx_chunk);
+	free(rx_chunk);
+err:
+	free_state();
+	return -1;
+}
+
+static void report(const struct sofi_init_parameters *params, float snr,
+		   const struct result *r)
+{
+	float esn0 = snr + 10.f * log10f(0.5f * sim_rate / params->baud);
+	float ebn0 = esn0 - 10.f * log10f((float)params->symbol_width);
+	double air_time = (double)r->air_frames / sim_rate;
+
+	printf("%.1f,%.1f,%.1f,%d,%.1f,%lu,%lu,%lu,%lu,%lu,%.3e,%.4f,%.1f\n",
+	       snr, ebn0, params->baud, params->symbol_width,
+	       params->interpacket_gap_factor, num_packets, r->ok, r->corrupt,
+	       r->missed, r->spurious,
+	       r->bits ? (double)r->bit_errors / r->bits : 1.,
+	       1. - (double)r->ok / num_packets,
+	       air_time > 0. ? r->ok * payload_length * CHAR_BIT / air_time : 0.);
+	fflush(stdout);
+}
+
+/* Parse a comma-separated list of numbers. */
+static int parse_list(const char *s, float *list)
+{
+	char *end;
+	int n = 0;
+
+	for (;;) {
+		if (n == MAX_SWEEP)
+			return -1;
+		list[n++] = strtof(s, &end);
+		if (end == s)
+			return -1;
+		if (*end == '\0')
+			return n;
+		if (*end != ',')
+			return -1;
+		s = end + 1;
+	}
+}
+
+static void usage(bool error)
+{
+	fprintf(error ? stderr : stdout,
+		"usage: %s [OPTION]...\n"
+		"Measure bit and packet error rates over a simulated noisy channel.\n"
+		"\n"
+		"Sweeps (comma-separated lists):\n"
+		"  --snr=DB               SNRs over the whole band (default\n"
+		"                         10,12,14,16,18,20,25)\n"
+		"  --baud=BAUD            symbol rates (default 1200)\n"
+		"  --width=BITS           symbol widths (default 1,2)\n"
+		"  --gap=FACTOR           interpacket gaps in symbols (default 15)\n"
+		"\n"
+		"Other options:\n"
+		"  --packets=N            packets per point (default 100)\n"
+		"  --length=BYTES         payload length (default 32)\n"
+		"  --rate=HZ              sample rate of the channel (default 48000)\n"
+		"  --spacing=HZ           tone spacing (default: the baud)\n"
+		"  --sample-format=FORMAT float32 (the default) or int16\n"
+		"  --seed=N               seed for the payloads and the noise\n"
+		"  --max-per=PER          exit with an error if any point loses more\n"
+		"                         than this fraction of its packets\n"
+		"  -d, --debug            trace the receiver\n"
+		"  -h, --help             display this help text and exit\n",
+		progname);
+	exit(error ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Long options without a short equivalent. */
+enum {
+	OPT_SNR = 256,
+	OPT_BAUD,
+	OPT_WIDTH,
+	OPT_GAP,
+	OPT_PACKETS,
+	OPT_LENGTH,
+	OPT_RATE,
+	OPT_SPACING,
+	OPT_SAMPLE_FORMAT,
+	OPT_SEED,
+	OPT_MAX_PER,
+};
+
+int main(int argc, char **argv)
+{
+	struct sofi_init_parameters params = DEFAULT_SOFI_INIT_PARAMS;
+	struct result r;
+	int status = EXIT_SUCCESS;
+	char *end;
+
+	if (argc > 0)
+		progname = argv[0];
+
+	for (;;) {
+		static struct option long_options[] = {
+			{"snr",			required_argument,	NULL,	OPT_SNR},
+			{"baud",		required_argument,	NULL,	OPT_BAUD},
+			{"width",		required_argument,	NULL,	OPT_WIDTH},
+			{"gap",			required_argument,	NULL,	OPT_GAP},
+			{"packets",		required_argument,	NULL,	OPT_PACKETS},
+			{"length",		required_argument,	NULL,	OPT_LENGTH},
+			{"rate",		required_argument,	NULL,	OPT_RATE},
+			{"spacing",		required_argument,	NULL,	OPT_SPACING},
+			{"sample-format",	required_argument,	NULL,	OPT_SAMPLE_FORMAT},
+			{"seed",		required_argument,	NULL,	OPT_SEED},
+			{"max-per",		required_argument,	NULL,	OPT_MAX_PER},
+			{"debug",		no_argument,		NULL,	'd'},
+			{"help",		no_argument,		NULL,	'h'},
+			{NULL, 0, NULL, 0},
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "dh", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case OPT_SNR:
+			if ((num_snrs = parse_list(optarg, snrs)) < 0)
+				usage(true);
+			break;
+		case OPT_BAUD:
+			if ((num_bauds = parse_list(optarg, bauds)) < 0)
+				usage(true);
+			break;
+		case OPT_WIDTH:
+			if ((num_widths = parse_list(optarg, widths)) < 0)
+				usage(true);
+			for (int i = 0; i < num_widths; i++) {
+				if (widths[i] != 1.f && widths[i] != 2.f &&
+				    widths[i] != 4.f && widths[i] != 8.f) {
+					fprintf(stderr, "%s: symbol width must be 1, 2, 4, or 8\n",
+						progname);
+					usage(true);
+				}
+			}
+			break;
+		case OPT_GAP:
+			if ((num_gaps = parse_list(optarg, gaps)) < 0)
+				usage(true);
+			break;
+		case OPT_PACKETS:
+			num_packets = strtoul(optarg, &end, 10);
+			if (*end != '\0' || !num_packets)
+				usage(true);
+			break;
+		case OPT_LENGTH:
+			payload_length = (int)strtol(optarg, &end, 10);
+			if (*end != '\0' || payload_length < (int)sizeof(uint32_t) ||
+			    payload_length > UINT8_MAX)
+				usage(true);
+			break;
+		case OPT_RATE:
+			sim_rate = strtol(optarg, &end, 10);
+			if (*end != '\0' || sim_rate <= 0)
+				usage(true);
+			break;
+		case OPT_SPACING:
+			spacing = strtof(optarg, &end);
+			if (*end != '\0' || spacing <= 0.f)
+				usage(true);
+			break;
+		case OPT_SAMPLE_FORMAT:
+			if (strcmp(optarg, "float32") == 0)
+				sample_format = SOFI_SAMPLE_FLOAT32;
+			else if (strcmp(optarg, "int16") == 0)
+				sample_format = SOFI_SAMPLE_INT16;
+			else
+				usage(true);
+			break;
+		case OPT_SEED:
+			seed = (uint32_t)strtoul(optarg, &end, 10);
+			if (*end != '\0')
+				usage(true);
+			break;
+		case OPT_MAX_PER:
+			max_per = strtof(optarg, &end);
+			if (*end != '\0' || max_per < 0.f || max_per > 1.f)
+				usage(true);
+			break;
+		case 'd':
+			debug++;
+			break;
+		case 'h':
+			usage(false);
+			break;
+		default:
+			usage(true);
+		}
+	}
+	if (optind != argc)
+		usage(true);
+
+	params.sample_rate = sim_rate;
+	params.sample_format = sample_format;
+	params.debug_level = debug;
+
+	printf("snr_db,ebn0_db,baud,width,gap,packets,ok,corrupt,missed,spurious,ber,per,goodput_bps\n");
+	for (int b = 0; b < num_bauds; b++) {
+		for (int w = 0; w < num_widths; w++) {
+			for (int g = 0; g < num_gaps; g++) {
+				params.baud = bauds[b];
+				params.symbol_width = (int)widths[w];
+				params.interpacket_gap_factor = gaps[g];
+				for (int i = 0; i < (1 << params.symbol_width); i++) {
+					params.symbol_freqs[i] =
+						(i + 1) * (spacing ? spacing : params.baud);
+				}
+				for (int i = 0; i < num_snrs; i++) {
+					double start = monotonic_time();
+
+					if (simulate(&params, snrs[i], &r)) {
+						fprintf(stderr, "%s: skipping %.1f baud, width %d\n",
+							progname, params.baud,
+							params.symbol_width);
+						status = EXIT_FAILURE;
+						break;
+					}
+					report(&params, snrs[i], &r);
+					if (1. - (double)r.ok / num_packets > max_per) {
+						fprintf(stderr, "%s: %.1f baud, width %d: "
+							"PER above %g at %.1f dB\n",
+							progname, params.baud,
+							params.symbol_width, max_per,
+							snrs[i]);
+						status = EXIT_FAILURE;
+					}
+					debug_printf(1, "%.1fx real time\n",
+						     r.air_frames / (double)sim_rate /
+						     (monotonic_time() - start));
+				}
+			}
+		}
+	}
+	return status;
+}
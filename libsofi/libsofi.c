@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
@@ -10,9 +12,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "sofi.h"
+#include "pa_memorybarrier.h"
 #include "pa_ringbuffer.h"
+#include "resample.h"
+#include "stat.h"
+#include "tap.h"
+#include "trace.h"
 
 #define M_PI 3.14159265359f
 
@@ -28,20 +36,192 @@ void debug_printf(int v, const char *format, ...)
 	}
 }
 
+/*
+ * Messages from the receiver thread are written to a trace ring rather than
+ * straight to stderr, which would hold up demodulation, and printed by a
+ * thread of their own. Levels above SOFI_TRACE_LEVEL are left out of the build
+ * altogether.
+ */
+#ifndef SOFI_TRACE_LEVEL
+#define SOFI_TRACE_LEVEL 3
+#endif
+#define TRACE_PERIOD 50 /* ms */
+static struct trace_ring receiver_trace;
+static pthread_t trace_thread;
+
+#define trace(v, ...) do {						\
+	static struct trace_site site_;					\
+									\
+	if ((v) <= SOFI_TRACE_LEVEL && debug_level >= (v))		\
+		trace_record(&receiver_trace, &site_, __VA_ARGS__);	\
+} while (0)
+
+static void *trace_loop(void *arg)
+{
+	int ret;
+	(void)arg;
+
+	for (;; pthread_testcancel()) {
+		ret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		assert(ret == 0);
+		trace_drain(&receiver_trace, stderr);
+		ret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		assert(ret == 0);
+		Pa_Sleep(TRACE_PERIOD);
+	}
+	return (void *)0;
+}
+
 /* Globals, mostly for the sake of cleanup or lifetime. */
 static struct callback_data data;
-static PaStream *stream;
+static PaStream *input_stream, *output_stream;
 static void *sender_buffer_ptr;
 static void *receiver_buffer_ptr;
-static float *window_buffer;
+static void *window_buffer;
 static pthread_t receiver_thread;
-static bool receiver;
+static bool sender, receiver;
+
+/*
+ * Worst case number of symbols in a message: the header byte plus the length,
+ * payload, and CRC, doubled by FEC, at one bit per symbol.
+ */
+#define MAX_MESSAGE_SYMBOLS \
+	((1 + 2 * (sizeof(struct sofi_packet) + sizeof(uint32_t))) * CHAR_BIT)
 
 struct raw_message {
 	size_t len;
-	unsigned char symbols[(sizeof(struct sofi_packet) + sizeof(uint32_t)) * 8];
+	/* Number of symbols in the header, which is sent at the base rate. */
+	size_t header_len;
+	/* Rung of the rate ladder that the body is sent at, and its symbol width. */
+	int rung;
+	int width;
+	/* This is a rate control frame or a probe rather than a client packet. */
+	bool control;
+	/* The sender is waiting for a rate report after this message. */
+	bool poll;
+	/* Measured signal-to-noise ratio in dB (receiver only). */
+	float snr;
+	/*
+	 * Mean power of the decided tones and of each of the others in dB
+	 * relative to a full-scale tone at the input, the symbol rate of the
+	 * body, and the link's clock and frequency offsets as of the end of the
+	 * message (receiver only).
+	 */
+	float signal_level, noise_level;
+	float baud;
+	float clock_offset, freq_offset;
+	/*
+	 * Monotonic time in seconds that the message was queued for sending, or
+	 * that its first sample left the ADC.
+	 */
+	double timestamp;
+	/*
+	 * Monotonic times that its last sample left the ADC and that it was
+	 * demodulated (receiver only).
+	 */
+	double ended, demodulated;
+	unsigned char symbols[MAX_MESSAGE_SYMBOLS];
 };
 
+/*
+ * Counters for sofi_get_stats(). The audio callbacks, the receiver thread, and
+ * client threads all update them with the helpers in stat.h, and
+ * sofi_get_stats() loads them one field at a time.
+ */
+static struct sofi_stats stats;
+
+static double monotonic_time(void)
+{
+	struct timespec ts;
+	int ret;
+
+	ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(ret == 0);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Deadlines are kept on the monotonic clock, but the pthread timed waits take a
+ * CLOCK_REALTIME time.
+ */
+static void realtime_deadline(double deadline, struct timespec *ts)
+{
+	double t;
+	int ret;
+
+	ret = clock_gettime(CLOCK_REALTIME, ts);
+	assert(ret == 0);
+	t = ts->tv_sec + ts->tv_nsec / 1e9 + (deadline - monotonic_time());
+	ts->tv_sec = (time_t)t;
+	ts->tv_nsec = (long)((t - (double)ts->tv_sec) * 1e9);
+}
+
+/*
+ * Sleep for up to ms milliseconds, but not past the deadline.
+ *
+ * Return: 0, or -1 without sleeping if the deadline has passed.
+ */
+static int sleep_until(double deadline, float ms)
+{
+	double left = 1000. * (deadline - monotonic_time());
+
+	if (left <= 0.)
+		return -1;
+	Pa_Sleep(left < ms ? (long)ceil(left) : (long)ms);
+	return 0;
+}
+
+/*
+ * Lock a mutex, giving up at the deadline, which may be INFINITY.
+ *
+ * Return: 0 if the mutex is locked, -1 if the deadline passed first.
+ */
+static int lock_until(pthread_mutex_t *mutex, double deadline)
+{
+	struct timespec ts;
+	int ret;
+
+	if (deadline == INFINITY) {
+		ret = pthread_mutex_lock(mutex);
+	} else if (deadline <= monotonic_time()) {
+		ret = pthread_mutex_trylock(mutex);
+		if (ret == EBUSY)
+			return -1;
+	} else {
+		realtime_deadline(deadline, &ts);
+		ret = pthread_mutex_timedlock(mutex, &ts);
+		if (ret == ETIMEDOUT)
+			return -1;
+	}
+	assert(ret == 0);
+	return 0;
+}
+
+static void record_latency(unsigned long *histogram, double seconds)
+{
+	double ms = seconds * 1000.;
+	int i = 0;
+
+	while (ms >= 1. && i < SOFI_LATENCY_BUCKETS - 1) {
+		ms /= 2.;
+		i++;
+	}
+	stat_add(&histogram[i], 1);
+}
+
+static void record_stage(enum sofi_stage stage, double seconds)
+{
+	struct sofi_stage_stats *s = &stats.stages[stage];
+
+	/* Clocks that are off by a little can make a short stage negative. */
+	if (seconds < 0.)
+		seconds = 0.;
+	stat_add(&s->packets, 1);
+	stat_add_double(&s->total, seconds);
+	stat_max_double(&s->max, seconds);
+	record_latency(s->histogram, seconds);
+}
+
 /*
  * Receive queue. Received messages are placed here as they are demodulated and
  * removed as the client calls sofi_recv(). Messages will be dropped if they
@@ -68,67 +248,530 @@ static inline void recv_queue_enqueue(const struct raw_message *msg)
 		assert(ret == 0);
 	} else {
 		/* The message is dropped if the queue overflows. */
-		debug_printf(1, "recv_queue overflow\n");
+		stat_add(&stats.recv_queue_overflows, 1);
+		trace(1, "recv_queue overflow\n");
 	}
 
 	ret = pthread_mutex_unlock(&recv_queue_lock);
 	assert(ret == 0);
 }
 
-static inline void recv_queue_dequeue(struct raw_message *msg)
+/*
+ * Take the next message off the queue, waiting for one until the deadline,
+ * which may be INFINITY.
+ *
+ * Return: 0 on success, -1 if the deadline passed first.
+ */
+static inline int recv_queue_dequeue(struct raw_message *msg, double deadline)
 {
-	int ret;
+	struct timespec ts;
+	int ret, err = 0;
 
 	ret = pthread_mutex_lock(&recv_queue_lock);
 	assert(ret == 0);
 
+	if (!recv_queue_size && deadline != INFINITY)
+		realtime_deadline(deadline, &ts);
 	while (!recv_queue_size) {
-		ret = pthread_cond_wait(&recv_queue_cond, &recv_queue_lock);
+		if (deadline == INFINITY) {
+			ret = pthread_cond_wait(&recv_queue_cond, &recv_queue_lock);
+		} else if (deadline <= monotonic_time()) {
+			err = -1;
+			break;
+		} else {
+			ret = pthread_cond_timedwait(&recv_queue_cond,
+						     &recv_queue_lock, &ts);
+			if (ret == ETIMEDOUT)
+				continue;
+		}
 		assert(ret == 0);
 	}
-	memcpy(msg, &recv_queue[recv_queue_start], sizeof(struct raw_message));
-	recv_queue_start = (recv_queue_start + 1) % RECV_QUEUE_CAP;
-	recv_queue_size--;
+	if (!err) {
+		memcpy(msg, &recv_queue[recv_queue_start], sizeof(struct raw_message));
+		recv_queue_start = (recv_queue_start + 1) % RECV_QUEUE_CAP;
+		recv_queue_size--;
+	}
 
 	ret = pthread_mutex_unlock(&recv_queue_lock);
 	assert(ret == 0);
+	return err;
 }
 
 /* Transmission parameters. */
 #define SENDER_BUFFER_SIZE 2UL /* 2 packets. */
 #define RECEIVER_BUFFER_SIZE (1UL << 20) /* 1M samples. */
 
+/*
+ * The requested sample rate and the rates the input and output streams were
+ * actually opened at, which can differ when they are on different devices.
+ * None of them can change without reopening the streams.
+ */
 static long sample_rate;
-static float baud;
-static float recv_window_factor;
-static float interpacket_gap_factor;
+static long input_rate, output_rate;
+
+/*
+ * Whether the streams and all of the receiver's buffers hold 16-bit samples,
+ * which are processed in fixed point, instead of floats.
+ */
+static bool int16_samples;
+
+static inline size_t sample_size(void)
+{
+	return int16_samples ? sizeof(int16_t) : sizeof(float);
+}
+
+/*
+ * Captured channels, which are kept interleaved in all of the receiver's
+ * buffers, and how their tone strengths are combined.
+ */
+#define MAX_INPUT_CHANNELS 8
+static int input_channels;
+static enum sofi_combining combining;
+
+static inline size_t frame_size(void)
+{
+	return input_channels * sample_size();
+}
+
+/*
+ * Output channels, each of which carries its own sender queue and modulator.
+ * Rate adaptation only runs on channel 0, which is the one paired with our
+ * receiver.
+ */
+#define MAX_OUTPUT_CHANNELS 8
+static int output_channels;
+
+/*
+ * Quarter-wave-symmetric sine table in Q15 for the fixed-point oscillators,
+ * indexed by the top bits of a 32-bit phase accumulator.
+ */
+#define SINE_TABLE_BITS 10
+#define SINE_TABLE_SIZE (1 << SINE_TABLE_BITS)
+static int16_t sine_table[SINE_TABLE_SIZE];
+
+static void sine_init(void)
+{
+	for (int i = 0; i < SINE_TABLE_SIZE; i++)
+		sine_table[i] = (int16_t)lrintf(32767.f * sinf(2.f * M_PI * i / SINE_TABLE_SIZE));
+}
+
+static inline int16_t nco_sin(uint32_t phase)
+{
+	return sine_table[phase >> (32 - SINE_TABLE_BITS)];
+}
+
+static inline int16_t nco_cos(uint32_t phase)
+{
+	return sine_table[((phase >> (32 - SINE_TABLE_BITS)) + SINE_TABLE_SIZE / 4) &
+			  (SINE_TABLE_SIZE - 1)];
+}
+
+/* Phase accumulator increment for a frequency at a sample rate. */
+static inline uint32_t nco_step(float frequency, long rate)
+{
+	return (uint32_t)((double)frequency / rate * 4294967296.);
+}
+
+/*
+ * The receiver doesn't demodulate at the device rate, which is usually far
+ * higher than the tones need. The callback captures at the device rate, and
+ * the receiver thread runs the capture through a decimating front-end in chunks
+ * into a second ring buffer at a rate picked from the frequency plan. The
+ * sender synthesizes at the device rate directly.
+ */
+#define CAPTURE_CHUNK 4096
+#define RESAMPLER_TAPS 32
+#define RESAMPLER_PASSBAND 0.4f /* of the lower rate */
+/*
+ * Fewest samples in a listen window. A shorter window can't get a carrier past
+ * the energy gate, so the detector rate isn't lowered below the rate that gives
+ * this many.
+ */
+#define MIN_RECV_WINDOW 16
+static PaUtilRingBuffer modem_buffer;
+static void *modem_buffer_ptr;
+static void *capture_chunk, *resampled_chunk;
+/* One channel of a chunk before and after resampling. */
+static void *channel_in, *channel_out;
 
-static inline int receiver_window(void)
+/*
+ * Modulation parameters. These can be changed by sofi_reconfigure() while the
+ * stream is running, so they are double-buffered: the callback latches the
+ * active block at the start of each message and the receiver thread latches it
+ * whenever it is listening for a carrier, and a new block is only written into
+ * the inactive slot once neither of them is using it anymore.
+ */
+struct modem_params {
+	float baud;
+	float recv_window_factor;
+	float interpacket_gap_factor;
+	/* Size of a symbol in bits (must be 1, 2, 4, or 8). */
+	int symbol_width;
+	/* Frequencies in Hz for each symbol value. */
+	float symbol_freqs[1 << 8];
+	/*
+	 * Fixed-point oscillator increments for each symbol at the device rate
+	 * and at the detector rate.
+	 */
+	uint32_t tx_steps[1 << 8];
+	uint32_t rx_steps[1 << 8];
+	bool rate_adaptation;
+	/* The fastest rung of the rate ladder that the frequency plan allows. */
+	int max_rung;
+	/* The rate the receiver demodulates at. */
+	long rate;
+	/*
+	 * Front-end from the device rate to rate for each input channel, or
+	 * NULL if they are the same. Its state belongs to the receiver thread.
+	 */
+	struct resampler *front_end;
+};
+
+static struct modem_params param_blocks[2];
+static volatile int active_params;
+/* The block that the receiver thread has latched. */
+static const struct modem_params *volatile receiver_params;
+
+static inline const struct modem_params *current_params(void)
+{
+	int i = active_params;
+
+	PaUtil_ReadMemoryBarrier();
+	return &param_blocks[i];
+}
+
+static inline int receiver_window(const struct modem_params *p)
 {
-	return (int)(recv_window_factor / baud * (float)sample_rate);
+	return (int)(p->recv_window_factor / p->baud * (float)p->rate);
 }
 
-static inline float interpacket_gap(void)
+static inline float interpacket_gap(const struct modem_params *p)
 {
-	return interpacket_gap_factor / baud;
+	return p->interpacket_gap_factor / p->baud;
 }
 
 /* Symbol definitions. */
 
-/* Size of a symbol in bits (must be 1, 2, 4, or 8). */
-static int symbol_width;
+static inline int num_symbols(const struct modem_params *p)
+{
+	return 1 << p->symbol_width;
+}
+
+static inline unsigned int symbols_per_byte(const struct modem_params *p)
+{
+	return CHAR_BIT / p->symbol_width;
+}
+
+/*
+ * Rate ladder. With rate adaptation enabled, every message starts with a
+ * one-byte header sent at the base parameters which names the rung that the
+ * rest of the message is sent at. Every RATE_REPORT_INTERVAL packets, the
+ * sender polls the receiver and pauses to listen, and the receiver answers with
+ * a control frame reporting the SNR and error rate it has seen. The sender
+ * climbs or descends the ladder accordingly. Rungs are ordered from most robust
+ * to fastest.
+ */
+struct rate_rung {
+	/* Multiple of the base baud. */
+	float baud_factor;
+	/* Number of bits to drop from the base symbol width. */
+	int width_shift;
+	/* Protect the body with a Hamming(8,4) code. */
+	bool fec;
+	/* Reported SNR in dB required to step up to this rung. */
+	float min_snr;
+};
+
+static const struct rate_rung rate_ladder[] = {
+	{1.f, 1, true, 0.f},
+	{1.f, 0, true, 3.f},
+	{1.f, 0, false, 8.f},
+	{2.f, 0, false, 12.f},
+	{4.f, 0, false, 16.f},
+};
+
+/* The rung used when rate adaptation is disabled and before any feedback. */
+#define BASE_RUNG 2
+
+/* Rung number in a header that marks a control frame (sent at rung 0). */
+#define CONTROL_RUNG 7
+
+/* Number of data packets between polls for a rate report. */
+#define RATE_REPORT_INTERVAL 8
+
+/* Time in seconds to allow for the peer's latency in answering a poll. */
+#define RATE_REPORT_SLACK 0.25f
+
+/* Number of consecutive clean reports required before stepping up. */
+#define RATE_STEP_UP_REPORTS 2
+
+/* Margin in dB below a rung's min_snr before stepping down without errors. */
+#define RATE_HYSTERESIS 3.f
+
+static inline float rung_baud(const struct modem_params *p, int rung)
+{
+	return p->baud * rate_ladder[rung].baud_factor;
+}
+
+static inline int rung_width(const struct modem_params *p, int rung)
+{
+	int width = p->symbol_width >> rate_ladder[rung].width_shift;
+
+	return width ? width : 1;
+}
+
+/*
+ * Samples per symbol at the given sample rate and rung, or at the base rate if
+ * rung < 0.
+ */
+static inline unsigned long rung_symbol_frames(const struct modem_params *p,
+					       long rate, int rung)
+{
+	return (unsigned long)((float)rate /
+			       (rung < 0 ? p->baud : rung_baud(p, rung)));
+}
+
+/*
+ * The fastest rung that the frequency plan supports. Tones have to be at least
+ * one baud apart to be distinguishable over a symbol, so rungs that raise the
+ * baud past the tone spacing are unusable.
+ */
+static int compute_max_rung(const struct modem_params *p)
+{
+	int rung;
+
+	for (rung = BASE_RUNG + 1; rung < (int)(sizeof(rate_ladder) / sizeof(rate_ladder[0])); rung++) {
+		int n = 1 << rung_width(p, rung);
+
+		for (int i = 0; i < n; i++) {
+			for (int j = i + 1; j < n; j++) {
+				if (fabsf(p->symbol_freqs[i] - p->symbol_freqs[j]) < rung_baud(p, rung))
+					return rung - 1;
+			}
+		}
+	}
+	return rung - 1;
+}
+
+/* Rate control state, shared between the client threads and the receiver. */
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rate_cond = PTHREAD_COND_INITIALIZER;
+static int tx_rung = BASE_RUNG;
+static bool tx_feedback;
+static unsigned int tx_since_report;
+static unsigned int tx_clean_reports;
+static unsigned long tx_reports;
+static unsigned int rx_ok, rx_bad;
+static float rx_snr_sum;
+
+/*
+ * After a poll, channel 0 has to stay quiet until the report comes back or
+ * times out, and then until the peer's gap is over. Rather than holding up the
+ * client that sent the poll, the wait falls to the next client message.
+ */
+static struct {
+	bool pending;
+	/* tx_reports when the poll was queued. */
+	unsigned long reports;
+	/* When to give up on the report, or 0 while the poll is going out. */
+	double timeout;
+	/* When the peer is listening again, or 0 until the report is in. */
+	double quiet;
+} report_wait;
+
+struct rate_report {
+	/* Mean SNR over the reported packets in hundredths of a dB. */
+	int16_t snr;
+	uint8_t ok, bad;
+};
+
+/* Message coding. */
+
+static uint32_t crc32(unsigned char *buf, size_t len)
+{
+	uint32_t tab[256];
+	uint32_t val;
+
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			if (crc & 1)
+				crc = (crc >> 1) ^ UINT32_C(0xedb88320);
+			else
+				crc >>= 1;
+		}
+		tab[i] = crc;
+	}
+
+	val = ~UINT32_C(0);
+	for (size_t i = 0; i < len; i++) {
+		int idx = (uint8_t)val ^ (uint8_t)buf[i];
+		val = tab[idx] ^ (val >> 8);
+	}
+	return ~val;
+}
+
+/* Hamming(8,4) codewords for each nibble, and the decoding of each byte. */
+static unsigned char hamming_code[16];
+static unsigned char hamming_nibble[256];
+static unsigned char hamming_distance[256];
+
+static void hamming_init(void)
+{
+	for (int i = 0; i < 16; i++) {
+		unsigned int d1 = i & 1, d2 = (i >> 1) & 1;
+		unsigned int d3 = (i >> 2) & 1, d4 = (i >> 3) & 1;
+		unsigned int p1 = d1 ^ d2 ^ d4;
+		unsigned int p2 = d1 ^ d3 ^ d4;
+		unsigned int p3 = d2 ^ d3 ^ d4;
+		unsigned int p4 = d1 ^ d2 ^ d3 ^ d4 ^ p1 ^ p2 ^ p3;
+
+		hamming_code[i] = i | (p1 << 4) | (p2 << 5) | (p3 << 6) | (p4 << 7);
+	}
+
+	/*
+	 * Codewords are at least four bits apart, so a single bit error is
+	 * always corrected and a double bit error is detected.
+	 */
+	for (int c = 0; c < 256; c++) {
+		hamming_distance[c] = CHAR_BIT;
+		for (int i = 0; i < 16; i++) {
+			unsigned int x = c ^ hamming_code[i];
+			unsigned char distance = 0;
+
+			while (x) {
+				distance += x & 1;
+				x >>= 1;
+			}
+			if (distance < hamming_distance[c]) {
+				hamming_distance[c] = distance;
+				hamming_nibble[c] = i;
+			}
+		}
+	}
+}
+
+static void pack_byte(struct raw_message *msg, unsigned char c, int width)
+{
+	for (int j = 0; j < CHAR_BIT / width; j++) {
+		msg->symbols[msg->len++] = c & ((1 << width) - 1);
+		c >>= width;
+	}
+}
+
+/*
+ * encode_message() - modulate a buffer into symbols
+ *
+ * The body is sent at the given rung; the header naming the rung is only sent
+ * when rate adaptation is enabled. Control frames are always sent at rung 0.
+ */
+static void encode_message(const struct modem_params *p,
+			   struct raw_message *msg, const unsigned char *buf,
+			   size_t size, int rung, bool control, bool poll)
+{
+	const struct rate_rung *r;
+
+	if (control)
+		rung = 0;
+	r = &rate_ladder[rung];
+	msg->len = 0;
+	msg->rung = rung;
+	msg->width = rung_width(p, rung);
+	msg->control = control;
+	msg->poll = poll;
+	if (p->rate_adaptation) {
+		unsigned char nibble = (poll << 3) | (control ? CONTROL_RUNG : rung);
+
+		pack_byte(msg, hamming_code[nibble], p->symbol_width);
+	}
+	msg->header_len = msg->len;
 
-/* Frequencies in Hz for each symbol value. */
-static float symbol_freqs[1 << 8];
+	for (size_t i = 0; i < size; i++) {
+		if (r->fec) {
+			pack_byte(msg, hamming_code[buf[i] & 0xf], msg->width);
+			pack_byte(msg, hamming_code[buf[i] >> 4], msg->width);
+		} else {
+			pack_byte(msg, buf[i], msg->width);
+		}
+	}
+}
 
-static inline int num_symbols(void)
+/*
+ * parse_header() - decode the rung, frame type, and poll flag from a header
+ *
+ * Return: 0 on success, -1 if the header is corrupt or names an unsupported
+ * rung.
+ */
+static int parse_header(const struct modem_params *p, struct raw_message *msg)
 {
-	return 1 << symbol_width;
+	unsigned char c = 0;
+	unsigned char nibble;
+
+	for (size_t i = 0; i < msg->header_len; i++)
+		c |= msg->symbols[i] << (i * p->symbol_width);
+	if (hamming_distance[c] > 1)
+		return -1;
+	nibble = hamming_nibble[c];
+	msg->poll = nibble >> 3;
+	msg->control = (nibble & 0x7) == CONTROL_RUNG;
+	if (msg->control)
+		msg->rung = 0;
+	else if ((nibble & 0x7) <= p->max_rung)
+		msg->rung = nibble & 0x7;
+	else
+		return -1;
+	msg->width = rung_width(p, msg->rung);
+	return 0;
 }
 
-static inline unsigned int symbols_per_byte(void)
+/*
+ * decode_message() - demodulate the body of a message and check its CRC
+ * @buf: buffer of sizeof(struct sofi_packet) + sizeof(uint32_t) bytes
+ * @corrected: returns the number of bit errors corrected by FEC
+ *
+ * This prints nothing, since the receiver thread decodes messages too; callers
+ * report corrupt ones as their thread allows.
+ *
+ * Return: 0 if the message is intact, -1 if it is corrupt.
+ */
+static int decode_message(const struct raw_message *msg, unsigned char *buf,
+			  unsigned int *corrected)
 {
-	return CHAR_BIT / symbol_width;
+	const size_t size = sizeof(struct sofi_packet) + sizeof(uint32_t);
+	unsigned char coded[2 * (sizeof(struct sofi_packet) + sizeof(uint32_t))];
+	const struct rate_rung *r = &rate_ladder[msg->rung];
+	int width = msg->width;
+	unsigned int per_byte = CHAR_BIT / width;
+	uint8_t len;
+	uint32_t crc1, crc2;
+
+	memset(coded, 0, sizeof(coded));
+	for (size_t i = 0; i < msg->len - msg->header_len; i++) {
+		unsigned char c = msg->symbols[msg->header_len + i] <<
+				  ((i % per_byte) * width);
+		if (i / per_byte < sizeof(coded))
+			coded[i / per_byte] |= c;
+	}
+
+	*corrected = 0;
+	if (r->fec) {
+		for (size_t i = 0; i < size; i++) {
+			unsigned char lo = coded[2 * i], hi = coded[2 * i + 1];
+
+			buf[i] = hamming_nibble[lo] | (hamming_nibble[hi] << 4);
+			if (hamming_distance[lo] == 1)
+				(*corrected)++;
+			if (hamming_distance[hi] == 1)
+				(*corrected)++;
+		}
+	} else {
+		memcpy(buf, coded, size);
+	}
+
+	memcpy(&len, buf, sizeof(len));
+	memcpy(&crc1, buf + sizeof(len) + len, sizeof(crc1));
+	crc2 = crc32(buf, sizeof(len) + len);
+	return crc1 == crc2 ? 0 : -1;
 }
 
 /* Internal state. */
@@ -142,364 +785,3117 @@ enum sender_state {
 enum receiver_state {
 	RECV_STATE_LISTEN,
 	RECV_STATE_DEMODULATE,
+	RECV_STATE_DISCARD,
 };
 
 struct callback_data {
 	struct sender_callback_data {
 		enum sender_state state;
 		PaUtilRingBuffer buffer;
+		const struct modem_params *params;
 		struct raw_message *msg;
 		size_t index;
 		unsigned char symbol;
 		unsigned long frame;
+		unsigned long symbol_frames;
 		float phase;
-	} sender;
+		uint32_t nco_phase, nco_step;
+		/* DAC times at which the last interpacket gap started and ended. */
+		double gap_start, gap_end;
+	} sender[MAX_OUTPUT_CHANNELS];
 	struct receiver_callback_data {
 		PaUtilRingBuffer buffer;
 	} receiver;
 };
 
+/*
+ * Monotonic time at which the first frame of the current output buffer reaches
+ * the DAC, and how long after the output callback that is.
+ */
+static double output_dac_time, output_latency;
+
+/*
+ * A rate report waiting to go out on channel 0. It is filled in while it is
+ * empty, under rate_lock, and the sender callback plays it ahead of the ring
+ * once the poller is listening again and empties it after its gap. Nothing
+ * that answers a poll has to wait on the sender.
+ */
+static struct raw_message report_msg;
+static const struct modem_params *report_params;
+static double report_not_before;
+static volatile bool report_queued;
+
+/*
+ * Time the sender's stages of a client message that starts at frame i of the
+ * current output buffer. The sender works on the DAC's schedule, which runs
+ * output_latency behind the monotonic clock.
+ */
+static void record_send_stages(const struct sender_callback_data *data,
+			       unsigned long i)
+{
+	double played = output_dac_time + (double)i / output_rate;
+	double queued = data->msg->timestamp + output_latency;
+	double gap;
+
+	gap = data->gap_end - (queued > data->gap_start ? queued : data->gap_start);
+	if (gap < 0.)
+		gap = 0.;
+	record_stage(SOFI_STAGE_QUEUE, played - queued - gap);
+	record_stage(SOFI_STAGE_GAP, gap);
+	record_stage(SOFI_STAGE_OUTPUT, output_latency);
+}
+
 static void sender_callback(void *output_buffer,
 			    unsigned long frames_per_buffer,
-			    struct sender_callback_data *data)
+			    struct sender_callback_data *data, int channel)
 {
 	ring_buffer_size_t ret;
 	float *out = output_buffer;
+	int16_t *out16 = output_buffer;
 	float frequency;
 	void *data1, *data2;
 	ring_buffer_size_t size1, size2;
 	bool first = false;
 
 	for (unsigned long i = 0; i < frames_per_buffer; i++) {
+		unsigned long j = i * output_channels + channel;
+
 		switch (data->state) {
 		case SEND_STATE_IDLE:
-			ret = PaUtil_GetRingBufferReadRegions(&data->buffer, 1,
-							      &data1, &size1,
-							      &data2, &size2);
-			if (ret == 0) {
-				out[i] = 0.f;
-				break;
-			}
-			assert(size1 == 1);
-			assert(size2 == 0);
+			if (channel == 0 && report_queued &&
+			    output_dac_time + (double)i / output_rate >=
+			    report_not_before) {
+				PaUtil_ReadMemoryBarrier();
+				data->params = report_params;
+				data->msg = &report_msg;
+			} else {
+				ret = PaUtil_GetRingBufferReadRegions(&data->buffer,
+								      1, &data1,
+								      &size1,
+								      &data2,
+								      &size2);
+				if (ret == 0)
+					break;
+				assert(size1 == 1);
+				assert(size2 == 0);
 
-			data->msg = data1;
+				data->params = current_params();
+				data->msg = data1;
+			}
 			data->index = 0;
 			data->state = SEND_STATE_TRANSMITTING;
+			if (!data->msg->control) {
+				record_latency(stats.enqueue_to_air,
+					       monotonic_time() -
+					       data->msg->timestamp);
+				record_send_stages(data, i);
+			}
 			first = true;
 			/* Fallthrough. */
 		case SEND_STATE_TRANSMITTING:
-			if (first || ++data->frame >= sample_rate / baud) {
+			if (first || ++data->frame >= data->symbol_frames) {
 				if (data->index >= data->msg->len) {
+					if (!data->msg->control)
+						stat_add(&stats.packets_sent, 1);
 					data->state = SEND_STATE_INTERPACKET_GAP;
 					data->frame = 0;
-					out[i] = 0.f;
+					data->gap_start = output_dac_time +
+							  (double)i / output_rate;
 					break;
 				}
+				if (data->index < data->msg->header_len)
+					data->symbol_frames = rung_symbol_frames(data->params,
+										 output_rate, -1);
+				else
+					data->symbol_frames = rung_symbol_frames(data->params,
+										 output_rate,
+										 data->msg->rung);
 				data->symbol = data->msg->symbols[data->index++];
+				data->nco_step = data->params->tx_steps[data->symbol];
 				data->frame = 0;
 			}
 
-			out[i] = sinf(data->phase);
-			frequency = symbol_freqs[data->symbol];
-			data->phase += (2.f * M_PI * frequency) / sample_rate;
-			while (data->phase >= 2.f * M_PI)
-				data->phase -= 2.f * M_PI;
+			if (int16_samples) {
+				out16[j] = nco_sin(data->nco_phase);
+				data->nco_phase += data->nco_step;
+			} else {
+				out[j] = sinf(data->phase);
+				frequency = data->params->symbol_freqs[data->symbol];
+				data->phase += (2.f * M_PI * frequency) / output_rate;
+				while (data->phase >= 2.f * M_PI)
+					data->phase -= 2.f * M_PI;
+			}
 			first = false;
 			break;
 		case SEND_STATE_INTERPACKET_GAP:
-			out[i] = 0.f;
-			if (++data->frame >= interpacket_gap() * sample_rate) {
-				PaUtil_AdvanceRingBufferReadIndex(&data->buffer, 1);
+			if (++data->frame >= interpacket_gap(data->params) * output_rate) {
+				if (data->msg == &report_msg) {
+					PaUtil_FullMemoryBarrier();
+					report_queued = false;
+				} else {
+					PaUtil_AdvanceRingBufferReadIndex(&data->buffer, 1);
+				}
 				data->state = SEND_STATE_IDLE;
+				data->gap_end = output_dac_time +
+						(double)(i + 1) / output_rate;
 			}
 			break;
 		}
 	}
 }
 
+/* Callbacks that lost input, in the device or because the receiver fell behind. */
+static unsigned long capture_overflows;
+
+/*
+ * Capture clock: the number of frames written to the capture ring in all, and
+ * the monotonic time at which the frame after the last of them leaves the ADC.
+ * While the capture is gated during a transmission, the input device's frames
+ * don't reach the ring but the time still moves on, so the clock keeps the last
+ * gap's length and where in the ring it fell, and frames from before it are
+ * put that much earlier. Frames from before the gap before that are rarely
+ * still waiting in the ring, and come out late by its length. There is one
+ * writer at a time, the input callback or sofi_replay(), and the receiver reads
+ * the fields together under the sequence count, which is odd while they are
+ * being written.
+ */
+static struct {
+	volatile unsigned long seq;
+	volatile unsigned long frames;
+	volatile unsigned long gap_end, gap;
+	volatile double time;
+} capture_clock;
+
+/* Frames of the capture ring that the receiver's front-end has consumed. */
+static unsigned long capture_consumed;
+
+static void advance_capture_clock(unsigned long frames, double time)
+{
+	capture_clock.seq++;
+	PaUtil_WriteMemoryBarrier();
+	capture_clock.frames += frames;
+	capture_clock.time = time;
+	PaUtil_WriteMemoryBarrier();
+	capture_clock.seq++;
+}
+
+/* Move the capture clock on past frames that the gate kept out of the ring. */
+static void skip_capture_clock(unsigned long frames, double time)
+{
+	capture_clock.seq++;
+	PaUtil_WriteMemoryBarrier();
+	if (capture_clock.gap_end != capture_clock.frames) {
+		capture_clock.gap_end = capture_clock.frames;
+		capture_clock.gap = 0;
+	}
+	capture_clock.gap += frames;
+	capture_clock.time = time;
+	PaUtil_WriteMemoryBarrier();
+	capture_clock.seq++;
+}
+
+/* Monotonic time at which a frame of the capture ring left the ADC. */
+static double capture_frame_time(unsigned long frame)
+{
+	unsigned long seq, frames, gap_end, gap;
+	double time;
+
+	do {
+		seq = capture_clock.seq;
+		PaUtil_ReadMemoryBarrier();
+		frames = capture_clock.frames;
+		gap_end = capture_clock.gap_end;
+		gap = capture_clock.gap;
+		time = capture_clock.time;
+		PaUtil_ReadMemoryBarrier();
+	} while ((seq & 1) || seq != capture_clock.seq);
+	if ((long)(frame - gap_end) < 0)
+		frames += gap;
+	return time - (double)(long)(frames - frame) / input_rate;
+}
+
+/*
+ * Turn a time on a stream's clock into monotonic time, given the monotonic time
+ * at the start of the callback. Hosts that don't report the time get the start
+ * of the callback instead.
+ */
+static double stream_time(const PaStreamCallbackTimeInfo *time_info,
+			  PaTime time, double start)
+{
+	if (time <= 0. || time_info->currentTime <= 0.)
+		return start;
+	return start + (time - time_info->currentTime);
+}
+
 static void receiver_callback(const void *input_buffer,
 			      unsigned long frames_per_buffer,
-			      struct receiver_callback_data *data)
+			      struct receiver_callback_data *data,
+			      double adc_time)
 {
 	ring_buffer_size_t ret;
 
-	ret = PaUtil_GetRingBufferWriteAvailable(&data->buffer);
-	assert((unsigned long)ret >= frames_per_buffer);
 	ret = PaUtil_WriteRingBuffer(&data->buffer, input_buffer, frames_per_buffer);
-	assert((unsigned long)ret == frames_per_buffer);
+	if ((unsigned long)ret < frames_per_buffer)
+		stat_add(&capture_overflows, 1);
+	advance_capture_clock(ret, adc_time + (double)ret / input_rate);
+	ret = PaUtil_GetRingBufferReadAvailable(&data->buffer);
+	stat_max(&stats.capture_high_water, ret);
+}
+
+/*
+ * Account for one audio callback: the over- and underflows that PortAudio
+ * flagged on it, and how much of its buffer period it took to run.
+ */
+static void start_callback(struct sofi_callback_stats *s,
+			   PaStreamCallbackFlags status_flags)
+{
+	stat_add(&s->calls, 1);
+	if (status_flags & (paInputUnderflow | paOutputUnderflow))
+		stat_add(&s->underflows, 1);
+	if (status_flags & (paInputOverflow | paOutputOverflow))
+		stat_add(&s->overflows, 1);
+}
+
+static void end_callback(struct sofi_callback_stats *s, double start,
+			 unsigned long frames, long rate)
+{
+	float load;
+	int i;
+
+	/* A callback without frames has no period to measure the load against. */
+	if (!frames)
+		return;
+	load = (float)((monotonic_time() - start) * rate / frames);
+	i = (int)(load * (SOFI_LOAD_BUCKETS - 1));
+	stat_add(&s->load[i < SOFI_LOAD_BUCKETS - 1 ? i : SOFI_LOAD_BUCKETS - 1], 1);
+	stat_max_float(&s->max_load, load);
+}
+
+/*
+ * Sample tap, when recording. While a recording is being replayed, the input
+ * device is ignored so that the receiver only sees the recording. Each input
+ * callback that sees replaying set counts itself in replay_acks, so that once
+ * the count moves no callback is still writing captured samples.
+ */
+#define TAP_PERIOD 20 /* ms */
+static struct tap tap;
+static pthread_t tap_thread;
+static bool recording;
+static volatile bool replaying, restart_receiver;
+static volatile unsigned long replay_acks;
+
+static void tap_stream(enum tap_stream stream, const void *samples,
+		       unsigned long frames, int channels, long rate,
+		       double time)
+{
+	struct tap_chunk chunk = {
+		.stream = stream,
+		.channels = channels,
+		.rate = rate,
+		.format = int16_samples ? SOFI_SAMPLE_INT16 : SOFI_SAMPLE_FLOAT32,
+		.frames = frames,
+		.time = time,
+	};
+
+	tap_write(&tap, &chunk, samples, frames * channels * sample_size());
 }
 
-static int sofi_callback(const void *input_buffer, void *output_buffer,
-			 unsigned long frames_per_buffer,
-			 const PaStreamCallbackTimeInfo *time_info,
-			 PaStreamCallbackFlags status_flags, void *arg)
+/*
+ * The input and output streams run from separate callbacks, possibly on
+ * different devices with different clocks, so the output callback leaves a
+ * flag for the input callback to keep us from listening to ourselves.
+ */
+static volatile bool transmitting;
+
+static int output_callback(const void *input_buffer, void *output_buffer,
+			   unsigned long frames_per_buffer,
+			   const PaStreamCallbackTimeInfo *time_info,
+			   PaStreamCallbackFlags status_flags, void *arg)
 {
 	struct callback_data *data = arg;
-	(void)time_info;
-	(void)status_flags;
+	double start = monotonic_time();
+	bool idle = true;
+	(void)input_buffer;
 
-	if (output_buffer)
-		sender_callback(output_buffer, frames_per_buffer, &data->sender);
-	if (input_buffer && data->sender.state == SEND_STATE_IDLE)
-		receiver_callback(input_buffer, frames_per_buffer, &data->receiver);
+	start_callback(&stats.output, status_flags);
+	output_dac_time = stream_time(time_info, time_info->outputBufferDacTime,
+				      start);
+	output_latency = output_dac_time - start;
+
+	/* Silence unless a channel is in the middle of a symbol. */
+	memset(output_buffer, 0,
+	       frames_per_buffer * output_channels * sample_size());
+	for (int ch = 0; ch < output_channels; ch++) {
+		sender_callback(output_buffer, frames_per_buffer,
+				&data->sender[ch], ch);
+		if (data->sender[ch].state != SEND_STATE_IDLE)
+			idle = false;
+	}
+	transmitting = !idle;
+	if (recording)
+		tap_stream(TAP_PLAYBACK, output_buffer, frames_per_buffer,
+			   output_channels, output_rate,
+			   time_info->outputBufferDacTime);
 
+	end_callback(&stats.output, start, frames_per_buffer, output_rate);
 	return paContinue;
 }
 
-static void *receiver_loop(void *arg)
+static int input_callback(const void *input_buffer, void *output_buffer,
+			  unsigned long frames_per_buffer,
+			  const PaStreamCallbackTimeInfo *time_info,
+			  PaStreamCallbackFlags status_flags, void *arg)
 {
-	PaUtilRingBuffer *buffer = arg;
-	enum receiver_state state = RECV_STATE_LISTEN;
-	ring_buffer_size_t ring_ret;
-	struct raw_message msg;
-	int symbol;
-	float max_strength;
+	struct callback_data *data = arg;
+	double start = monotonic_time(), adc_time;
+	(void)output_buffer;
 
-	for (;; pthread_testcancel()) {
-		int window_size;
+	start_callback(&stats.input, status_flags);
+	if (status_flags & paInputOverflow)
+		stat_add(&capture_overflows, 1);
+	adc_time = stream_time(time_info, time_info->inputBufferAdcTime, start);
+	if (replaying) {
+		replay_acks++;
+	} else if (!transmitting) {
+		receiver_callback(input_buffer, frames_per_buffer, &data->receiver,
+				  adc_time);
+		if (recording)
+			tap_stream(TAP_CAPTURE, input_buffer, frames_per_buffer,
+				   input_channels, input_rate,
+				   time_info->inputBufferAdcTime);
+	} else {
+		skip_capture_clock(frames_per_buffer,
+				   adc_time + (double)frames_per_buffer / input_rate);
+	}
+
+	end_callback(&stats.input, start, frames_per_buffer, input_rate);
+	return paContinue;
+}
+
+static void handle_control_frame(const struct raw_message *msg);
+static void rate_feedback(const struct modem_params *p,
+			  const struct raw_message *msg);
+static void rate_bad_header(void);
+
+/* Smallest tone amplitude that counts as a carrier. */
+#define CARRIER_AMPLITUDE 0.125f
 
-		if (state == RECV_STATE_LISTEN)
-			window_size = receiver_window();
+/*
+ * Offsets between the sender and the receiver that are tracked from symbol to
+ * symbol while demodulating. They are properties of the link rather than of a
+ * packet, so at the end of each packet its average is folded into a long-term
+ * estimate, weighted by the number of symbols it covered, and the next packet
+ * starts from there.
+ */
+struct offset_tracker {
+	/* The loop's current value and the long-term estimate. */
+	float value, estimate;
+	/* Sum of the values over the current packet. */
+	float sum;
+	unsigned int symbols;
+};
+
+static void reset_tracker(struct offset_tracker *t)
+{
+	t->value = t->estimate = t->sum = 0.f;
+	t->symbols = 0;
+}
+
+static void track_offset(struct offset_tracker *t, float delta, float max)
+{
+	t->value += delta;
+	if (t->value > max)
+		t->value = max;
+	else if (t->value < -max)
+		t->value = -max;
+	t->sum += t->value;
+	t->symbols++;
+}
+
+static void fold_tracker(struct offset_tracker *t, float memory)
+{
+	if (t->symbols) {
+		float n = (float)t->symbols;
+
+		t->estimate += (t->sum / n - t->estimate) * n / (n + memory);
+	}
+	t->value = t->estimate;
+	t->sum = 0.f;
+	t->symbols = 0;
+}
+
+/*
+ * Frequency offset, relative to the nominal tones. Doppler from moving nodes
+ * and the difference between the two sample clocks both scale every tone by
+ * the same factor, so the reference tones are scaled to match. It is estimated
+ * by interpolating the decided tone's strength between its neighbours half a
+ * bin either side. A real tone also has a mirror image at the negative
+ * frequency, which leaks into the lower neighbour and pulls the estimate down
+ * when there are only a few cycles in the window, so tones with fewer than
+ * FREQ_MIN_CYCLES are left out.
+ */
+#define FREQ_GAIN 0.25f
+#define FREQ_MEMORY 100.f /* symbols */
+#define MAX_FREQ_OFFSET 0.05f
+#define FREQ_MIN_CYCLES 8
+static struct offset_tracker freq_tracker;
+
+static inline float rx_freq(const struct modem_params *p, int tone)
+{
+	return p->symbol_freqs[tone] * (1.f + freq_tracker.value);
+}
+
+static inline uint32_t rx_step(const struct modem_params *p, int tone)
+{
+	uint32_t step = p->rx_steps[tone];
+
+	return step + (uint32_t)(int32_t)((float)step * freq_tracker.value);
+}
+
+/*
+ * Correlate len frames of the window from start with each symbol's tone. The
+ * strength of a tone is the squared magnitude of its correlation, on the same
+ * scale for both sample formats.
+ */
+static void tone_strengths(const struct modem_params *p, int start, int len,
+			   int width, int channel, float *strengths)
+{
+	int stride = input_channels;
+	const float *x = (const float *)window_buffer + start * stride + channel;
+
+	for (int i = 0; i < (1 << width); i++) {
+		float freq = rx_freq(p, i);
+		float sin_i = 0.f, cos_i = 0.f;
+
+		for (int j = 0; j < len; j++) {
+			sin_i += sinf(2.f * M_PI * freq * (float)j / (float)p->rate) * x[j * stride];
+			cos_i += cosf(2.f * M_PI * freq * (float)j / (float)p->rate) * x[j * stride];
+		}
+		strengths[i] = sin_i * sin_i + cos_i * cos_i;
+	}
+}
+
+/*
+ * The same in fixed point, with Q15 samples against the Q15 sine table. Only
+ * the final scaling is done in floating point, once per tone and window.
+ */
+static void tone_strengths_s16(const struct modem_params *p, int start,
+			       int len, int width, int channel, float *strengths)
+{
+	int stride = input_channels;
+	const int16_t *x = (const int16_t *)window_buffer + start * stride + channel;
+
+	for (int i = 0; i < (1 << width); i++) {
+		uint32_t phase = 0, step = rx_step(p, i);
+		int64_t sin_i = 0, cos_i = 0;
+		float s, c;
+
+		for (int j = 0; j < len; j++) {
+			sin_i += (int32_t)nco_sin(phase) * x[j * stride];
+			cos_i += (int32_t)nco_cos(phase) * x[j * stride];
+			phase += step;
+		}
+		s = (float)sin_i / (1 << 30);
+		c = (float)cos_i / (1 << 30);
+		strengths[i] = s * s + c * c;
+	}
+}
+
+/*
+ * Resample one channel of the chunk in capture_chunk into resampled_chunk and
+ * return the number of frames.
+ */
+static size_t resample_channel(struct resampler *r, int channel, size_t len)
+{
+	size_t n;
+
+	if (input_channels == 1) {
+		if (int16_samples)
+			return resampler_process_s16(r, capture_chunk, len,
+						     resampled_chunk);
 		else
-			window_size = (int)((float)sample_rate / baud);
+			return resampler_process(r, capture_chunk, len,
+						 resampled_chunk);
+	}
+
+	if (int16_samples) {
+		const int16_t *in = capture_chunk;
+		int16_t *x = channel_in, *y = channel_out, *out = resampled_chunk;
+
+		for (size_t i = 0; i < len; i++)
+			x[i] = in[i * input_channels + channel];
+		n = resampler_process_s16(r, x, len, y);
+		for (size_t i = 0; i < n; i++)
+			out[i * input_channels + channel] = y[i];
+	} else {
+		const float *in = capture_chunk;
+		float *x = channel_in, *y = channel_out, *out = resampled_chunk;
+
+		for (size_t i = 0; i < len; i++)
+			x[i] = in[i * input_channels + channel];
+		n = resampler_process(r, x, len, y);
+		for (size_t i = 0; i < n; i++)
+			out[i * input_channels + channel] = y[i];
+	}
+	return n;
+}
+
+/*
+ * Automatic gain control. Levels at the receiver vary by orders of magnitude
+ * with distance, so each block is scaled to bring the peaks of its loudest
+ * channel to AGC_TARGET, which keeps CARRIER_AMPLITUDE meaningful. One gain is
+ * shared by all of the channels so that combining still sees their relative
+ * levels. The gain drops at once when the level rises and recovers at
+ * AGC_RELEASE when it falls, and it is held while a packet is being
+ * demodulated, since a step in the middle of a symbol would throw off the
+ * symbol clock. Amplification is also capped to keep the noise floor well
+ * under CARRIER_AMPLITUDE, or an idle receiver would turn noise into carriers.
+ * The floor is the quietest block level, allowed to creep up at AGC_FLOOR_RISE
+ * so that it follows a noisier room. Blocks are short enough to fit between
+ * packets.
+ *
+ * Blocks are at fixed positions in the modem ring buffer and are leveled in
+ * place just before the detector's windows reach them, so the gain only
+ * depends on the samples and not on how the capture happened to be chunked.
+ * Each block's level is measured over AGC_LOOKAHEAD blocks, so that the gain
+ * has already come down when a carrier starts near the end of a block.
+ */
+#define AGC_BLOCK 0.002f /* seconds */
+#define AGC_LOOKAHEAD 2 /* blocks */
+#define AGC_TARGET 0.5f
+#define AGC_MIN_GAIN 0.1f
+#define AGC_MAX_GAIN 100.f
+#define AGC_RELEASE 2.3f /* per second, about 20 dB/s */
+#define AGC_FLOOR_RISE 0.115f /* per second, about 1 dB/s */
+#define AGC_NOISE_CEILING (CARRIER_AMPLITUDE / 8.f)
+static volatile float agc_gain;
+static float agc_floor;
+/* Frames past the read index of the modem ring buffer that have been leveled. */
+static size_t agc_ahead;
+
+/* Samples this close to full scale count as clipped. */
+#define CLIP_LEVEL 0.999f
+static unsigned long clipped_samples;
+
+static void reset_agc(void)
+{
+	agc_gain = AGC_MAX_GAIN;
+	agc_floor = INFINITY;
+	agc_ahead = 0;
+}
+
+static void count_clips(const void *chunk, size_t samples)
+{
+	unsigned long clipped = 0;
+
+	if (int16_samples) {
+		const int16_t *x = chunk;
+		int16_t level = (int16_t)(CLIP_LEVEL * INT16_MAX);
 
-		if (PaUtil_GetRingBufferReadAvailable(buffer) < window_size) {
-			Pa_Sleep(1000.f * window_size / sample_rate);
+		for (size_t i = 0; i < samples; i++) {
+			if (x[i] >= level || x[i] <= -level)
+				clipped++;
+		}
+	} else {
+		const float *x = chunk;
+
+		for (size_t i = 0; i < samples; i++) {
+			if (fabsf(x[i]) >= CLIP_LEVEL)
+				clipped++;
+		}
+	}
+	stat_add(&clipped_samples, clipped);
+}
+
+static void measure_level(const void *x, size_t samples, float *peak,
+			  float *energy)
+{
+	if (int16_samples) {
+		const int16_t *y = x;
+
+		for (size_t i = 0; i < samples; i++) {
+			float v = y[i] / 32768.f;
+
+			*peak = fmaxf(*peak, fabsf(v));
+			*energy += v * v;
+		}
+	} else {
+		const float *y = x;
+
+		for (size_t i = 0; i < samples; i++) {
+			*peak = fmaxf(*peak, fabsf(y[i]));
+			*energy += y[i] * y[i];
+		}
+	}
+}
+
+static void apply_gain(void *x, size_t samples, float gain)
+{
+	if (int16_samples) {
+		int16_t *y = x;
+		int32_t g = (int32_t)(gain * (1 << 12)); /* Q12 */
+
+		for (size_t i = 0; i < samples; i++) {
+			int64_t v = ((int64_t)y[i] * g) >> 12;
+
+			y[i] = v > INT16_MAX ? INT16_MAX :
+			       v < INT16_MIN ? INT16_MIN : (int16_t)v;
+		}
+	} else {
+		float *y = x;
+
+		for (size_t i = 0; i < samples; i++)
+			y[i] *= gain;
+	}
+}
+
+/* Find the frames at offset past the read index of a ring buffer. */
+static void ring_regions(PaUtilRingBuffer *ring, size_t offset, size_t frames,
+			 void *x[2], size_t n[2])
+{
+	void *data[2];
+	ring_buffer_size_t size[2];
+
+	PaUtil_GetRingBufferReadRegions(ring, offset + frames, &data[0],
+					&size[0], &data[1], &size[1]);
+	for (int i = 0; i < 2; i++) {
+		x[i] = NULL;
+		n[i] = 0;
+		if (offset >= (size_t)size[i]) {
+			offset -= size[i];
 			continue;
 		}
+		x[i] = (char *)data[i] + offset * frame_size();
+		n[i] = size[i] - offset < frames ? size[i] - offset : frames;
+		frames -= n[i];
+		offset = 0;
+	}
+}
+
+/*
+ * Level the block of frames at offset past the read index of a ring buffer in
+ * place. AGC_LOOKAHEAD blocks from there on must be available.
+ */
+static void apply_agc(PaUtilRingBuffer *ring, size_t offset, size_t frames,
+		      long rate, bool hold)
+{
+	void *x[2];
+	size_t n[2];
+	float dt = (float)frames / (float)rate;
+	float peak = 0.f, energy = 0.f, target, gain = agc_gain;
 
-		ring_ret = PaUtil_ReadRingBuffer(buffer, window_buffer,
-						 window_size);
-		assert(ring_ret == window_size);
+	if (hold)
+		goto apply;
+	ring_regions(ring, offset, AGC_LOOKAHEAD * frames, x, n);
+	for (int i = 0; i < 2; i++) {
+		if (n[i])
+			measure_level(x[i], n[i] * input_channels, &peak, &energy);
+	}
+	agc_floor = fminf(sqrtf(energy / (AGC_LOOKAHEAD * frames *
+					  input_channels)),
+			  agc_floor * expf(AGC_FLOOR_RISE * dt));
 
-		debug_printf(3, "symbol strengths = [");
-		symbol = -1;
-		max_strength = 100.f; /* XXX: need a real heuristic for silence. */
-		for (int i = 0; i < num_symbols(); i++) {
-			float sin_i = 0.f, cos_i = 0.f;
-			float strength;
-
-			for (int j = 0; j < window_size; j++) {
-				sin_i += sinf(2.f * M_PI * symbol_freqs[i] * (float)j / (float)sample_rate) * window_buffer[j];
-				cos_i += cosf(2.f * M_PI * symbol_freqs[i] * (float)j / (float)sample_rate) * window_buffer[j];
-			}
-			strength = sin_i * sin_i + cos_i * cos_i;
-			if (strength > max_strength) {
-				max_strength = strength;
-				symbol = i;
-			}
+	target = peak > 0.f ? AGC_TARGET / peak : AGC_MAX_GAIN;
+	if (agc_floor > 0.f)
+		target = fminf(target, fmaxf(AGC_NOISE_CEILING / agc_floor, 1.f));
+	target = fminf(fmaxf(target, AGC_MIN_GAIN), AGC_MAX_GAIN);
+	if (target < gain)
+		gain = target;
+	else
+		gain = fminf(target, gain * expf(AGC_RELEASE * dt));
+	agc_gain = gain;
+
+apply:
+	ring_regions(ring, offset, frames, x, n);
+	for (int i = 0; i < 2; i++) {
+		if (n[i])
+			apply_gain(x[i], n[i] * input_channels, gain);
+	}
+}
+
+/*
+ * Move everything captured so far through the front-end into the modem ring
+ * buffer, unless the detector has fallen so far behind that it won't fit.
+ * Clipping is counted on the raw capture.
+ */
+static void run_front_end(const struct modem_params *p,
+			  PaUtilRingBuffer *capture)
+{
+	ring_buffer_size_t avail;
+	size_t len, n;
 
-			debug_printf(3, "%s%f", (i > 0) ? ", " : "", strength);
+	while ((avail = PaUtil_GetRingBufferReadAvailable(capture)) > 0) {
+		len = avail < CAPTURE_CHUNK ? (size_t)avail : CAPTURE_CHUNK;
+		n = p->front_end ? resampler_max_output(p->front_end, len) : len;
+		if (n > (size_t)PaUtil_GetRingBufferWriteAvailable(&modem_buffer))
+			break;
+		if (p->front_end) {
+			PaUtil_ReadRingBuffer(capture, capture_chunk, len);
+			count_clips(capture_chunk, len * input_channels);
+			/* The front-ends are in lockstep, so they all return the same. */
+			for (int ch = 0; ch < input_channels; ch++)
+				n = resample_channel(&p->front_end[ch], ch, len);
+		} else {
+			PaUtil_ReadRingBuffer(capture, resampled_chunk, len);
+			count_clips(resampled_chunk, len * input_channels);
 		}
-		debug_printf(3, "] = %d\n", symbol);
+		PaUtil_WriteRingBuffer(&modem_buffer, resampled_chunk, n);
+		capture_consumed += len;
+	}
+}
 
-		switch (state) {
-		case RECV_STATE_LISTEN:
-			if (symbol != -1) {
-				memset(&msg, 0, sizeof(msg));
-				state = RECV_STATE_DEMODULATE;
-				debug_printf(2, "-> DEMODULATE\n");
+/*
+ * Monotonic time at which the frame offset frames past the read index of the
+ * modem ring left the ADC. The end of the modem ring lines up with the last
+ * frame that the front-end consumed, give or take the resampler's delay.
+ */
+static double modem_frame_time(const struct modem_params *p,
+			       PaUtilRingBuffer *buffer, size_t offset)
+{
+	return capture_frame_time(capture_consumed) -
+	       ((double)PaUtil_GetRingBufferReadAvailable(buffer) - offset) /
+	       p->rate;
+}
+
+/*
+ * Running signal and noise strengths of each input channel while
+ * demodulating, which weight the channels for maximal-ratio combining.
+ */
+#define CHANNEL_AVERAGING 8.f /* symbols */
+static float channel_signal[MAX_INPUT_CHANNELS];
+static float channel_noise[MAX_INPUT_CHANNELS];
+
+static void reset_channels(void)
+{
+	for (int ch = 0; ch < MAX_INPUT_CHANNELS; ch++)
+		channel_signal[ch] = channel_noise[ch] = 1.f;
+}
+
+static void update_channels(int width, float (*strengths)[1 << 8], int symbol)
+{
+	for (int ch = 0; ch < input_channels; ch++) {
+		float signal = strengths[ch][symbol], noise = 0.f;
+
+		for (int i = 0; i < (1 << width); i++) {
+			if (i != symbol)
+				noise += strengths[ch][i];
+		}
+		noise /= (1 << width) - 1;
+		channel_signal[ch] += (signal - channel_signal[ch]) / CHANNEL_AVERAGING;
+		channel_noise[ch] += (noise - channel_noise[ch]) / CHANNEL_AVERAGING;
+	}
+}
+
+/*
+ * Combine the per-channel tone strengths into one set for the symbol decision.
+ * Maximal-ratio combining averages the channels weighted by their running SNR;
+ * selection combining takes the channel whose strongest tone stands out the
+ * most above the others in this window.
+ */
+static void combine_channels(int width, float (*strengths)[1 << 8],
+			     float *combined)
+{
+	int n = 1 << width;
+
+	if (input_channels == 1) {
+		memcpy(combined, strengths[0], n * sizeof(float));
+		return;
+	}
+
+	if (combining == SOFI_COMBINE_SELECTION) {
+		float best_margin = -INFINITY;
+		int best = 0;
+
+		for (int ch = 0; ch < input_channels; ch++) {
+			float max = 0.f, sum = 0.f, margin;
+
+			for (int i = 0; i < n; i++) {
+				sum += strengths[ch][i];
+				if (strengths[ch][i] > max)
+					max = strengths[ch][i];
 			}
-			break;
-		case RECV_STATE_DEMODULATE:
-			if (symbol == -1) {
-				recv_queue_enqueue(&msg);
-				debug_printf(2, "-> LISTEN\n");
-				state = RECV_STATE_LISTEN;
-				break;
+			margin = max - (sum - max) / (n - 1);
+			if (margin > best_margin) {
+				best_margin = margin;
+				best = ch;
 			}
-			if (msg.len < sizeof(msg.symbols) / sizeof(msg.symbols[0]))
-				msg.symbols[msg.len++] = symbol;
-			break;
+		}
+		memcpy(combined, strengths[best], n * sizeof(float));
+	} else {
+		float weights[MAX_INPUT_CHANNELS], total = 0.f;
+
+		for (int ch = 0; ch < input_channels; ch++) {
+			weights[ch] = channel_noise[ch] > 0.f ?
+				      channel_signal[ch] / channel_noise[ch] : 1.f;
+			total += weights[ch];
+		}
+		for (int i = 0; i < n; i++) {
+			combined[i] = 0.f;
+			for (int ch = 0; ch < input_channels; ch++)
+				combined[i] += weights[ch] * strengths[ch][i];
+			combined[i] /= total;
 		}
 	}
-	return (void *)0;
 }
 
-int sofi_init(const struct sofi_init_parameters *params)
+/*
+ * Symbol timing recovery. The sender's and receiver's sample clocks can differ
+ * by hundreds of ppm, which slides the symbol windows off the symbols over a
+ * long message. While demodulating, the decided tone's strength over the early
+ * and late halves of each window shows whether the window started early (the
+ * previous symbol leaks into the early half) or late (the next one leaks into
+ * the late half). A second-order loop nudges the start of the next window and
+ * tracks the clock offset.
+ */
+#define TIMING_GAIN 0.5f
+#define CLOCK_GAIN 0.002f
+#define CLOCK_MEMORY 1000.f /* symbols */
+/* Symbols for the first window of a packet to be pulled into line. */
+#define CLOCK_SETTLE 8
+#define MAX_CLOCK_OFFSET 2e-3f /* 2000 ppm */
+static struct offset_tracker clock_tracker;
+
+/*
+ * Squared magnitude of the correlation with a tone of any frequency over part
+ * of the window.
+ */
+static float span_strength(const struct modem_params *p, int start, int len,
+			   int channel, float freq)
+{
+	int stride = input_channels;
+
+	if (int16_samples) {
+		const int16_t *x = (const int16_t *)window_buffer + channel;
+		uint32_t phase = 0, step = nco_step(freq, p->rate);
+		int64_t sin_i = 0, cos_i = 0;
+		float s, c;
+
+		for (int j = start; j < start + len; j++) {
+			sin_i += (int32_t)nco_sin(phase) * x[j * stride];
+			cos_i += (int32_t)nco_cos(phase) * x[j * stride];
+			phase += step;
+		}
+		s = (float)sin_i / (1 << 30);
+		c = (float)cos_i / (1 << 30);
+		return s * s + c * c;
+	} else {
+		const float *x = (const float *)window_buffer + channel;
+		float w = 2.f * M_PI * freq / (float)p->rate;
+		float sin_i = 0.f, cos_i = 0.f;
+
+		for (int j = 0; j < len; j++) {
+			sin_i += sinf(w * (float)j) * x[(start + j) * stride];
+			cos_i += cosf(w * (float)j) * x[(start + j) * stride];
+		}
+		return sin_i * sin_i + cos_i * cos_i;
+	}
+}
+
+/*
+ * Estimate how many samples late (negative) or early (positive) the window
+ * started from len frames of it from start. If it is off by d samples, the
+ * contaminated half loses about 4d/len of its strength, so the normalized
+ * difference between the halves is about 2d/len.
+ */
+static float timing_error(const struct modem_params *p, int start, int len,
+			  int symbol)
+{
+	int half = len / 2;
+	float freq = rx_freq(p, symbol);
+	float early = 0.f, late = 0.f;
+
+	for (int ch = 0; ch < input_channels; ch++) {
+		early += span_strength(p, start, half, ch, freq);
+		late += span_strength(p, start + len - half, half, ch, freq);
+	}
+	if (early + late <= 0.f)
+		return 0.f;
+	return (late - early) / (late + early) * len / 2.f;
+}
+
+/*
+ * Number of samples to move on to the next symbol, given the timing error of
+ * this one. timing carries the fractional part from symbol to symbol. The
+ * clock offset is left alone while the loop is still settling.
+ */
+static int next_symbol(float symbol_frames, float error, bool settled,
+		       float *timing)
+{
+	int advance;
+
+	/* Leakage from a neighbouring tone can exaggerate the error. */
+	if (error > symbol_frames / 4.f)
+		error = symbol_frames / 4.f;
+	else if (error < -symbol_frames / 4.f)
+		error = -symbol_frames / 4.f;
+	if (settled) {
+		track_offset(&clock_tracker, CLOCK_GAIN * error / symbol_frames,
+			     MAX_CLOCK_OFFSET);
+	}
+	*timing += symbol_frames * (1.f + clock_tracker.value) +
+		   TIMING_GAIN * error;
+	advance = *timing > 0.f ? (int)*timing : 0;
+	*timing -= advance;
+	return advance;
+}
+
+/*
+ * Estimate how far in Hz the decided tone is from its reference. Fitting a
+ * parabola through the magnitudes at the reference and half a bin either side
+ * puts the peak at offset * (left - right) / (2 * (left - 2 * centre + right)).
+ */
+static float frequency_error(const struct modem_params *p, int start, int len,
+			     float (*strengths)[1 << 8], int symbol)
+{
+	float delta = 0.5f * (float)p->rate / (float)len;
+	float freq = rx_freq(p, symbol);
+	float left = 0.f, centre = 0.f, right = 0.f, denom, peak;
+
+	for (int ch = 0; ch < input_channels; ch++) {
+		left += sqrtf(span_strength(p, start, len, ch, freq - delta));
+		centre += sqrtf(strengths[ch][symbol]);
+		right += sqrtf(span_strength(p, start, len, ch, freq + delta));
+	}
+	denom = left - 2.f * centre + right;
+	if (denom >= 0.f)
+		return 0.f;
+	peak = 0.5f * (left - right) / denom;
+	if (peak > 1.f)
+		peak = 1.f;
+	else if (peak < -1.f)
+		peak = -1.f;
+	return peak * delta;
+}
+
+/*
+ * Return the energy of the loudest channel over part of the window. By
+ * Cauchy-Schwarz, no tone can have a strength above len times this, which
+ * makes it a cheap gate in front of window_strengths() while listening: that
+ * costs a sine and a cosine per sample for every tone, this one multiply.
+ */
+static float window_energy(int start, int len)
+{
+	float energy[MAX_INPUT_CHANNELS] = {0.f};
+	float max = 0.f;
+
+	if (int16_samples) {
+		const int16_t *x = (const int16_t *)window_buffer +
+				   start * input_channels;
+		int64_t sum[MAX_INPUT_CHANNELS] = {0};
+
+		for (int j = 0; j < len; j++) {
+			for (int ch = 0; ch < input_channels; ch++)
+				sum[ch] += (int32_t)x[j * input_channels + ch] *
+					   x[j * input_channels + ch];
+		}
+		for (int ch = 0; ch < input_channels; ch++)
+			energy[ch] = (float)sum[ch] / (1 << 30);
+	} else {
+		const float *x = (const float *)window_buffer +
+				 start * input_channels;
+
+		for (int j = 0; j < len; j++) {
+			for (int ch = 0; ch < input_channels; ch++)
+				energy[ch] += x[j * input_channels + ch] *
+					      x[j * input_channels + ch];
+		}
+	}
+	for (int ch = 0; ch < input_channels; ch++)
+		max = fmaxf(max, energy[ch]);
+	return max;
+}
+
+/*
+ * Return where the carrier starts in a listen window that is longer than a
+ * symbol: the first quarter symbol with at least half the energy of the
+ * loudest one.
+ */
+static int carrier_onset(int window_size, int symbol_frames)
+{
+	int step = symbol_frames / 4 > 0 ? symbol_frames / 4 : 1;
+	float energy, max = 0.f;
+
+	for (int i = 0; i + step <= window_size; i += step)
+		max = fmaxf(max, window_energy(i, step));
+	for (int i = 0; i + step <= window_size; i += step) {
+		energy = window_energy(i, step);
+		if (energy >= 0.5f * max)
+			return i;
+	}
+	return 0;
+}
+
+/*
+ * Tone strengths of len frames of the window from start on every channel, and
+ * combined for the symbol decision.
+ */
+static void window_strengths(const struct modem_params *p, int start, int len,
+			     int width, float (*channel_strengths)[1 << 8],
+			     float *strengths)
+{
+	for (int ch = 0; ch < input_channels; ch++) {
+		if (int16_samples)
+			tone_strengths_s16(p, start, len, width, ch,
+					   channel_strengths[ch]);
+		else
+			tone_strengths(p, start, len, width, ch,
+				       channel_strengths[ch]);
+	}
+	combine_channels(width, channel_strengths, strengths);
+}
+
+/*
+ * Guard interval. In a reverberant room, echoes of the previous symbol linger
+ * at the start of each window, so symbols are decided on the tail of the
+ * window after a guard. Each packet retrains the guard on its first
+ * GUARD_TRAINING symbols: every candidate from none to three eighths of a
+ * symbol is tried on each of them, and the one under which the decided tone
+ * stands furthest above the strongest other tone wins. A longer guard also
+ * throws away signal and lets neighbouring tones leak into each other, and the
+ * measurement accounts for both. The symbol clock is steered on the same tail,
+ * which settles the guard's end just past the echoes. Half a symbol can win the
+ * training when its tail happens to hold whole cycles of every tone, but then
+ * the halves of the tail that the clock is steered on are too short to tell
+ * timing from phase, and the clock wanders off the symbols. The guard is kept
+ * in frames, since the echoes don't get shorter when the rate ladder speeds up.
+ */
+#define GUARD_STEPS 4 /* eighths of a symbol */
+#define GUARD_TRAINING 16 /* symbols */
+
+struct guard_training {
+	float wanted[GUARD_STEPS];
+	float unwanted[GUARD_STEPS];
+};
+
+static void train_guard(const struct modem_params *p, int window_size,
+			int width, int symbol, struct guard_training *t)
+{
+	float channel_strengths[MAX_INPUT_CHANNELS][1 << 8];
+	float strengths[1 << 8];
+
+	for (int g = 0; g < GUARD_STEPS; g++) {
+		int start = g * window_size / 8;
+		float other = 0.f;
+
+		window_strengths(p, start, window_size - start, width,
+				 channel_strengths, strengths);
+		for (int i = 0; i < (1 << width); i++) {
+			if (i != symbol && strengths[i] > other)
+				other = strengths[i];
+		}
+		t->wanted[g] += strengths[symbol];
+		t->unwanted[g] += other;
+	}
+}
+
+/* Return the trained guard in frames. */
+static int trained_guard(int window_size, const struct guard_training *t)
+{
+	int best = 0;
+
+	for (int g = 1; g < GUARD_STEPS; g++) {
+		if (t->wanted[g] * t->unwanted[best] >
+		    t->wanted[best] * t->unwanted[g])
+			best = g;
+	}
+	return best * window_size / 8;
+}
+
+/* Copy the next frames of a ring buffer without consuming them. */
+static void peek_ring_buffer(PaUtilRingBuffer *buffer, void *dst,
+			     ring_buffer_size_t frames)
+{
+	void *data1, *data2;
+	ring_buffer_size_t size1, size2;
+	size_t n1, n2;
+
+	PaUtil_GetRingBufferReadRegions(buffer, frames, &data1, &size1,
+					&data2, &size2);
+	n1 = size1 * buffer->elementSizeBytes;
+	n2 = size2 * buffer->elementSizeBytes;
+	memcpy(dst, data1, n1);
+	if (n2)
+		memcpy((char *)dst + n1, data2, n2);
+}
+
+/*
+ * Channel sounding. The probe is a message that steps through all 256 tones of
+ * the probe plan, SOUNDING_SWEEPS + 1 times. The receiver records the tone
+ * strengths of SOUNDING_WINDOWS symbols from wherever it picked up the carrier,
+ * which may be a few tones in if the first ones are in a null, and works out
+ * afterwards which tone each window was.
+ *
+ * Neighbouring tones hardly differ over half a symbol, which would blind the
+ * symbol clock, so the sweep hops SOUNDING_STRIDE tones at a time. Any odd
+ * stride visits every tone once per sweep.
+ */
+#define SOUNDING_SWEEPS 2
+#define SOUNDING_WINDOWS (SOUNDING_SWEEPS << 8)
+#define SOUNDING_STRIDE 97
+
+static inline int sounding_tone(int n)
+{
+	return (n * SOUNDING_STRIDE) & 0xff;
+}
+
+static pthread_mutex_t sounding_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sounding_cond = PTHREAD_COND_INITIALIZER;
+static float (*sounding_windows)[1 << 8];
+static size_t sounding_len;
+
+/* Whether to record the packet that is starting as a probe. */
+static bool sounding_armed(const struct modem_params *p)
+{
+	bool armed;
+	int ret;
+
+	ret = pthread_mutex_lock(&sounding_lock);
+	assert(ret == 0);
+	armed = sounding_windows && sounding_len < SOUNDING_WINDOWS &&
+		p->symbol_width == 8;
+	ret = pthread_mutex_unlock(&sounding_lock);
+	assert(ret == 0);
+	return armed;
+}
+
+/* Record one window of a probe. Return whether that was the last one. */
+static bool record_sounding(const float *strengths)
+{
+	bool done;
+	int ret;
+
+	ret = pthread_mutex_lock(&sounding_lock);
+	assert(ret == 0);
+	memcpy(sounding_windows[sounding_len++], strengths,
+	       sizeof(sounding_windows[0]));
+	done = sounding_len == SOUNDING_WINDOWS;
+	if (done) {
+		ret = pthread_cond_signal(&sounding_cond);
+		assert(ret == 0);
+	}
+	ret = pthread_mutex_unlock(&sounding_lock);
+	assert(ret == 0);
+	return done;
+}
+
+static void *receiver_loop(void *arg)
+{
+	PaUtilRingBuffer *capture = arg;
+	PaUtilRingBuffer *buffer = &modem_buffer;
+	const struct modem_params *p = NULL;
+	enum receiver_state state = RECV_STATE_LISTEN;
+	ring_buffer_size_t ring_ret;
+	struct raw_message msg;
+	int symbol;
+	float channel_strengths[MAX_INPUT_CHANNELS][1 << 8];
+	float strengths[1 << 8];
+	float max_strength, strength_sum, scale;
+	float signal_sum = 0.f, noise_sum = 0.f;
+	/* The same as powers relative to a full-scale tone. */
+	float signal_power = 0.f, noise_power = 0.f;
+	/* Frames to consume before the next window, and the fractional part. */
+	ring_buffer_size_t skip = 0;
+	float timing = 0.f;
+	int symbol_frames;
+	bool probing = false;
+	/* Frames at the start of each window to skip while demodulating. */
+	int guard = 0;
+	struct guard_training training;
+
+	for (;; pthread_testcancel()) {
+		int window_size;
+		int width;
+		int start;
+		size_t block;
+
+		/* Start over from nothing for sofi_replay(). */
+		if (restart_receiver) {
+			/* Nothing writes to the capture ring while it restarts. */
+			PaUtil_FlushRingBuffer(capture);
+			capture_consumed = capture_clock.frames;
+			PaUtil_FlushRingBuffer(&modem_buffer);
+			for (int ch = 0; p && p->front_end && ch < input_channels; ch++)
+				resampler_reset(&p->front_end[ch]);
+			reset_agc();
+			reset_channels();
+			reset_tracker(&clock_tracker);
+			reset_tracker(&freq_tracker);
+			state = RECV_STATE_LISTEN;
+			skip = 0;
+			guard = 0;
+			probing = false;
+			restart_receiver = false;
+		}
+
+		if (state == RECV_STATE_LISTEN) {
+			/* Pick up a new parameter block between packets. */
+			if (p != current_params()) {
+				/* Anything left over is at the old rate. */
+				if (p && p->rate != current_params()->rate) {
+					PaUtil_FlushRingBuffer(&modem_buffer);
+					skip = 0;
+					agc_ahead = 0;
+				}
+				p = current_params();
+				receiver_params = p;
+				guard = 0;
+			}
+			window_size = receiver_window(p);
+			width = p->symbol_width;
+		} else if (msg.len < msg.header_len) {
+			window_size = (int)rung_symbol_frames(p, p->rate, -1);
+			width = p->symbol_width;
+		} else {
+			window_size = (int)rung_symbol_frames(p, p->rate, msg.rung);
+			width = msg.width;
+		}
+
+		run_front_end(p, capture);
+		/* Level whole blocks up to the end of the next window. */
+		block = (size_t)(AGC_BLOCK * p->rate) + 1;
+		while (agc_ahead < (size_t)(skip + window_size) &&
+		       (size_t)PaUtil_GetRingBufferReadAvailable(buffer) >=
+		       agc_ahead + AGC_LOOKAHEAD * block) {
+			apply_agc(buffer, agc_ahead, block, p->rate,
+				  state != RECV_STATE_LISTEN);
+			agc_ahead += block;
+		}
+		if (skip) {
+			ring_ret = (ring_buffer_size_t)agc_ahead;
+			if (ring_ret > skip)
+				ring_ret = skip;
+			PaUtil_AdvanceRingBufferReadIndex(buffer, ring_ret);
+			agc_ahead -= ring_ret;
+			skip -= ring_ret;
+		}
+		if (skip || agc_ahead < (size_t)window_size) {
+			Pa_Sleep(1000.f * window_size / p->rate);
+			continue;
+		}
+
+		/*
+		 * Windows are peeked and consumed separately so that the symbol
+		 * clock can move the next one by a fraction of a symbol.
+		 */
+		peek_ring_buffer(buffer, window_buffer, window_size);
+		skip = window_size;
+		if (state == RECV_STATE_DEMODULATE && !probing)
+			start = guard < window_size / 2 ? guard : window_size / 2;
+		else
+			start = 0;
+
+		symbol = -1;
+		/*
+		 * XXX: need a real heuristic for silence. A tone of amplitude A
+		 * has a strength of about (A * window_size / 2)^2, so this
+		 * keeps the threshold at the same amplitude for every window
+		 * size and rate.
+		 */
+		max_strength = (CARRIER_AMPLITUDE * (window_size - start) / 2.f) *
+			       (CARRIER_AMPLITUDE * (window_size - start) / 2.f);
+		/* An idle receiver spends nearly all of its time here. */
+		if (state == RECV_STATE_LISTEN &&
+		    window_energy(start, window_size - start) *
+		    (window_size - start) <= max_strength)
+			continue;
+		strength_sum = 0.f;
+		window_strengths(p, start, window_size - start, width,
+				 channel_strengths, strengths);
+		for (int i = 0; i < (1 << width); i++) {
+			float strength = strengths[i];
+
+			strength_sum += strength;
+			if (strength > max_strength) {
+				max_strength = strength;
+				symbol = i;
+			}
+
+			trace(3, "strength %d = %f\n", i, strength);
+		}
+		trace(3, "symbol = %d\n", symbol);
+
+		switch (state) {
+		case RECV_STATE_LISTEN:
+			if (symbol != -1) {
+				memset(&msg, 0, sizeof(msg));
+				msg.rung = BASE_RUNG;
+				msg.width = p->symbol_width;
+				if (p->rate_adaptation)
+					msg.header_len = symbols_per_byte(p);
+				signal_sum = noise_sum = 0.f;
+				signal_power = noise_power = 0.f;
+				/*
+				 * The carrier started somewhere in this window. If
+				 * the window is longer than a symbol, start the
+				 * first symbol where its energy rises, and let the
+				 * symbol clock pull it into line.
+				 */
+				symbol_frames = (int)rung_symbol_frames(p, p->rate, -1);
+				skip = window_size > symbol_frames ?
+				       carrier_onset(window_size, symbol_frames) : 0;
+				msg.timestamp = modem_frame_time(p, buffer, skip);
+				timing = 0.f;
+				memset(&training, 0, sizeof(training));
+				probing = sounding_armed(p);
+				state = RECV_STATE_DEMODULATE;
+				trace(2, "-> DEMODULATE\n");
+			}
+			break;
+		case RECV_STATE_DEMODULATE:
+			/*
+			 * Tones of a probe can be lost in a null, so it runs
+			 * for a fixed number of windows instead of until the
+			 * carrier stops.
+			 */
+			if (probing) {
+				skip = next_symbol((float)p->rate / p->baud,
+						   symbol == -1 ? 0.f :
+						   timing_error(p, 0, window_size, symbol),
+						   false, &timing);
+				if (record_sounding(strengths)) {
+					trace(2, "probe recorded; -> DISCARD\n");
+					probing = false;
+					state = RECV_STATE_DISCARD;
+				}
+				break;
+			}
+			if (symbol == -1) {
+				/* The last symbol ended where this window starts. */
+				msg.ended = modem_frame_time(p, buffer, 0);
+				msg.demodulated = monotonic_time();
+				if (noise_sum > 0.f)
+					msg.snr = 10.f * log10f(signal_sum / noise_sum);
+				else
+					msg.snr = INFINITY;
+				if (msg.len) {
+					/* The gain is held while demodulating. */
+					float gain = 20.f * log10f(agc_gain);
+
+					msg.signal_level = 10.f * log10f(signal_power /
+									 msg.len) - gain;
+					msg.noise_level = 10.f * log10f(noise_power /
+									msg.len) - gain;
+				}
+				msg.baud = rung_baud(p, msg.rung);
+				fold_tracker(&clock_tracker, CLOCK_MEMORY);
+				fold_tracker(&freq_tracker, FREQ_MEMORY);
+				msg.clock_offset = clock_tracker.estimate;
+				msg.freq_offset = freq_tracker.estimate;
+				stat_set_float(&stats.clock_offset,
+					       1e6f * clock_tracker.estimate);
+				stat_set_float(&stats.frequency_offset,
+					       1e6f * freq_tracker.estimate);
+				trace(2, "clock offset = %+.0f ppm, frequency offset = %+.0f ppm\n",
+				      clock_tracker.estimate * 1e6f,
+				      freq_tracker.estimate * 1e6f);
+				if (msg.len < msg.header_len) {
+					trace(2, "header truncated\n");
+				} else if (msg.control) {
+					handle_control_frame(&msg);
+				} else {
+					rate_feedback(p, &msg);
+					recv_queue_enqueue(&msg);
+				}
+				trace(2, "-> LISTEN\n");
+				state = RECV_STATE_LISTEN;
+				break;
+			}
+			signal_sum += max_strength;
+			noise_sum += (strength_sum - max_strength) / ((1 << width) - 1);
+			/* A tone of amplitude A has a strength of about (A * n / 2)^2. */
+			scale = 4.f / ((float)(window_size - start) * (window_size - start));
+			signal_power += scale * max_strength;
+			noise_power += scale * (strength_sum - max_strength) /
+				       ((1 << width) - 1);
+			update_channels(width, channel_strengths, symbol);
+			skip = next_symbol((float)p->rate / (msg.len < msg.header_len ?
+							      p->baud :
+							      rung_baud(p, msg.rung)),
+					   timing_error(p, start, window_size - start,
+							symbol),
+					   msg.len >= CLOCK_SETTLE, &timing);
+			if (p->symbol_freqs[symbol] * (window_size - start) >=
+			    FREQ_MIN_CYCLES * p->rate) {
+				track_offset(&freq_tracker,
+					     FREQ_GAIN * frequency_error(p, start,
+									 window_size - start,
+									 channel_strengths,
+									 symbol) /
+					     p->symbol_freqs[symbol],
+					     MAX_FREQ_OFFSET);
+			}
+			if (msg.len < GUARD_TRAINING) {
+				train_guard(p, window_size, width, symbol,
+					    &training);
+				if (msg.len == GUARD_TRAINING - 1) {
+					guard = trained_guard(window_size,
+							      &training);
+					trace(2, "guard = %d samples\n", guard);
+				}
+			}
+			if (msg.len < sizeof(msg.symbols) / sizeof(msg.symbols[0]))
+				msg.symbols[msg.len++] = symbol;
+			if (msg.header_len && msg.len == msg.header_len &&
+			    parse_header(p, &msg) == -1) {
+				trace(2, "bad header; -> DISCARD\n");
+				rate_bad_header();
+				state = RECV_STATE_DISCARD;
+			}
+			break;
+		case RECV_STATE_DISCARD:
+			if (symbol == -1) {
+				trace(2, "-> LISTEN\n");
+				state = RECV_STATE_LISTEN;
+			}
+			break;
+		}
+	}
+	return (void *)0;
+}
+
+/*
+ * The sender ring buffers only support a single writer, but any number of
+ * client threads may send. This also keeps messages from being encoded with
+ * parameters that are being reconfigured. Each channel has its own lock so that
+ * a full queue on one doesn't hold up the others.
+ */
+static pthread_mutex_t send_locks[MAX_OUTPUT_CHANNELS];
+
+/* Client threads may be cancelled while they wait with a lock held. */
+static void unlock_mutex(void *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
+/* Lock every channel, in order, for reconfiguration. */
+static void lock_senders(void)
+{
+	int ret;
+
+	for (int ch = 0; ch < output_channels; ch++) {
+		ret = pthread_mutex_lock(&send_locks[ch]);
+		assert(ret == 0);
+	}
+}
+
+static void unlock_senders(void *arg)
+{
+	(void)arg;
+	for (int ch = output_channels - 1; ch >= 0; ch--)
+		pthread_mutex_unlock(&send_locks[ch]);
+}
+
+/*
+ * Wait until every message queued on a channel has been sent, including its
+ * gap, and on channel 0 any rate report.
+ */
+static void wait_sender_drained(int channel)
+{
+	while (PaUtil_GetRingBufferReadAvailable(&data.sender[channel].buffer) > 0 ||
+	       (channel == 0 && report_queued))
+		Pa_Sleep(CHAR_BIT * 1000.f / current_params()->baud);
+}
+
+static void wait_senders_drained(void)
+{
+	for (int ch = 0; ch < output_channels; ch++)
+		wait_sender_drained(ch);
+}
+
+static int next_tx_rung(const struct modem_params *p, bool *poll);
+
+/* Queue a message on a channel whose send lock is held. */
+static int queue_message(int channel, const unsigned char *buf, size_t size,
+			 int rung, bool control, bool *poll, double deadline)
+{
+	PaUtilRingBuffer *buffer = &data.sender[channel].buffer;
+	const struct modem_params *p = current_params();
+	struct raw_message msg;
+	bool poll_ = false;
+	int ret;
+
+	/* This is the only writer, so the room can't go away once it's there. */
+	while (!PaUtil_GetRingBufferWriteAvailable(buffer)) {
+		if (sleep_until(deadline, CHAR_BIT * 1000.f / p->baud))
+			return -1;
+	}
+	if (rung < 0)
+		rung = channel == 0 ? next_tx_rung(p, &poll_) : BASE_RUNG;
+	encode_message(p, &msg, buf, size, rung, control, poll_);
+	msg.timestamp = monotonic_time();
+	ret = PaUtil_WriteRingBuffer(buffer, &msg, 1);
+	assert(ret == 1);
+	if (poll)
+		*poll = poll_;
+	return 0;
+}
+
+/*
+ * send_message() - encode a buffer and queue it for the sender
+ * @channel: the output channel to send on
+ * @rung: the rung to send at, or -1 to let rate control pick
+ * @poll: returns whether the message polls for a rate report (may be NULL)
+ * @deadline: monotonic time to give up waiting for room at, or INFINITY
+ *
+ * The rung is only picked once there is room, so that a message that isn't
+ * queued doesn't count with rate control.
+ *
+ * Return: 0 if the message was queued, -1 if the deadline passed first.
+ */
+static int send_message(int channel, const unsigned char *buf, size_t size,
+			int rung, bool control, bool *poll, double deadline)
+{
+	int err;
+
+	if (lock_until(&send_locks[channel], deadline))
+		return -1;
+	pthread_cleanup_push(unlock_mutex, &send_locks[channel]);
+	err = queue_message(channel, buf, size, rung, control, poll, deadline);
+	pthread_cleanup_pop(1);
+	return err;
+}
+
+/*
+ * The lowest rate that keeps every tone in the front-end's passband and the
+ * listen window at least MIN_RECV_WINDOW samples long. It is a multiple of the
+ * fastest baud so that symbols are a whole number of samples long on every
+ * rung, and it falls back to the input device's rate if there is no such rate
+ * below it.
+ */
+static long detector_rate(const struct modem_params *p)
+{
+	float max_freq = 0.f, unit;
+	long rate, min_rate;
+
+	for (int i = 0; i < num_symbols(p); i++) {
+		if (p->symbol_freqs[i] > max_freq)
+			max_freq = p->symbol_freqs[i];
+	}
+	unit = rung_baud(p, p->max_rung);
+	if (unit != floorf(unit))
+		return input_rate;
+	/*
+	 * Odd bauds rarely divide the input rate evenly, so look for a higher
+	 * multiple that the resampler can reach.
+	 */
+	rate = (long)unit * ((long)(max_freq / RESAMPLER_PASSBAND / unit) + 1);
+	min_rate = (long)ceilf(MIN_RECV_WINDOW * unit / p->recv_window_factor);
+	if (rate < min_rate)
+		rate = (long)unit * ((min_rate + (long)unit - 1) / (long)unit);
+	for (; rate < input_rate; rate += (long)unit) {
+		if (resampler_supported(input_rate, rate))
+			return rate;
+	}
+	return input_rate;
+}
+
+static void free_front_end(struct modem_params *p)
+{
+	if (p->front_end) {
+		for (int ch = 0; ch < input_channels; ch++)
+			resampler_free(&p->front_end[ch]);
+		free(p->front_end);
+		p->front_end = NULL;
+	}
+}
+
+static int set_params(struct modem_params *p,
+		      const struct sofi_init_parameters *params)
+{
+	p->baud = params->baud;
+	p->recv_window_factor = params->recv_window_factor;
+	p->interpacket_gap_factor = params->interpacket_gap_factor;
+	p->symbol_width = params->symbol_width;
+	memcpy(p->symbol_freqs, params->symbol_freqs,
+	       num_symbols(p) * sizeof(float));
+	p->rate_adaptation = params->rate_adaptation;
+	p->max_rung = p->rate_adaptation ? compute_max_rung(p) : BASE_RUNG;
+
+	free_front_end(p);
+	p->rate = receiver ? detector_rate(p) : sample_rate;
+	for (int i = 0; i < num_symbols(p); i++) {
+		if (sender)
+			p->tx_steps[i] = nco_step(p->symbol_freqs[i], output_rate);
+		p->rx_steps[i] = nco_step(p->symbol_freqs[i], p->rate);
+	}
+	if (!receiver || p->rate == input_rate)
+		return 0;
+	p->front_end = calloc(input_channels, sizeof(*p->front_end));
+	if (!p->front_end) {
+		perror("calloc");
+		return -1;
+	}
+	for (int ch = 0; ch < input_channels; ch++) {
+		if (resampler_init(&p->front_end[ch], input_rate, p->rate,
+				   0.5f * (float)p->rate, RESAMPLER_TAPS)) {
+			free_front_end(p);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void dump_params(const struct modem_params *p)
+{
+	debug_printf(1,
+		     "Detector rate:\t\t%ld Hz\n"
+		     "Baud:\t\t\t%.2f symbols/sec, %d samples, %.4f seconds\n"
+		     "Window:\t\t\t%d samples, %.4f seconds\n"
+		     "Interpacket gap:\t%d samples, %.4f seconds\n",
+		     p->rate,
+		     p->baud, (int)((float)p->rate / p->baud), 1.f / p->baud,
+		     receiver_window(p), receiver_window(p) / (float)p->rate,
+		     (int)(interpacket_gap(p) * output_rate), interpacket_gap(p));
+	debug_printf(1, "Frequencies:\t\t");
+	for (int i = 0; i < num_symbols(p); i++)
+		debug_printf(1, "%s%.2f Hz", (i > 0) ? ", " : "", p->symbol_freqs[i]);
+	debug_printf(1, "\n");
+	if (p->rate_adaptation) {
+		debug_printf(1, "Rate ladder:\n");
+		for (int i = 0; i <= p->max_rung; i++) {
+			debug_printf(1, "\t\t\t%d: %.2f symbols/sec, %d bits/symbol%s%s\n",
+				     i, rung_baud(p, i), rung_width(p, i),
+				     rate_ladder[i].fec ? ", FEC" : "",
+				     i == BASE_RUNG ? " (base)" : "");
+		}
+	}
+}
+
+/* Reset the rate control state for a new set of parameters. */
+static void rate_reset(void)
+{
+	tx_rung = BASE_RUNG;
+	tx_feedback = false;
+	tx_since_report = tx_clean_reports = 0;
+	tx_reports = 0;
+	rx_ok = rx_bad = 0;
+	rx_snr_sum = 0.f;
+	report_wait.pending = false;
+}
+
+/*
+ * Device selection. Devices are looked up by name within a single host API so
+ * that we don't have to walk every device that PortAudio knows about, and the
+ * result can be cached in a file so that the next startup only has to check
+ * that the cached device index still has the same name.
+ */
+struct device_cache {
+	char host_api[64];
+	char input[256], output[256];
+	PaDeviceIndex input_index, output_index;
+	double input_latency, output_latency;
+	unsigned long frames_per_buffer;
+};
+
+static void read_device_cache(const char *path, struct device_cache *cache)
+{
+	char line[512];
+	FILE *file;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->input_index = cache->output_index = paNoDevice;
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno != ENOENT)
+			perror("fopen");
+		return;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		char *value = strchr(line, '=');
+
+		if (!value)
+			continue;
+		*value++ = '\0';
+		value[strcspn(value, "\n")] = '\0';
+		if (strcmp(line, "host_api") == 0)
+			snprintf(cache->host_api, sizeof(cache->host_api), "%s", value);
+		else if (strcmp(line, "input_device") == 0)
+			snprintf(cache->input, sizeof(cache->input), "%s", value);
+		else if (strcmp(line, "output_device") == 0)
+			snprintf(cache->output, sizeof(cache->output), "%s", value);
+		else if (strcmp(line, "input_index") == 0)
+			cache->input_index = atoi(value);
+		else if (strcmp(line, "output_index") == 0)
+			cache->output_index = atoi(value);
+		else if (strcmp(line, "input_latency") == 0)
+			cache->input_latency = atof(value);
+		else if (strcmp(line, "output_latency") == 0)
+			cache->output_latency = atof(value);
+		else if (strcmp(line, "frames_per_buffer") == 0)
+			cache->frames_per_buffer = strtoul(value, NULL, 10);
+	}
+	fclose(file);
+}
+
+static void write_device_cache(const char *path, const struct device_cache *cache)
+{
+	FILE *file;
+
+	file = fopen(path, "w");
+	if (!file) {
+		perror("fopen");
+		return;
+	}
+	fprintf(file, "host_api=%s\n", cache->host_api);
+	if (cache->input_index != paNoDevice) {
+		fprintf(file, "input_device=%s\n", cache->input);
+		fprintf(file, "input_index=%d\n", cache->input_index);
+		fprintf(file, "input_latency=%.6f\n", cache->input_latency);
+	}
+	if (cache->output_index != paNoDevice) {
+		fprintf(file, "output_device=%s\n", cache->output);
+		fprintf(file, "output_index=%d\n", cache->output_index);
+		fprintf(file, "output_latency=%.6f\n", cache->output_latency);
+	}
+	if (cache->frames_per_buffer != paFramesPerBufferUnspecified)
+		fprintf(file, "frames_per_buffer=%lu\n", cache->frames_per_buffer);
+	if (fclose(file))
+		perror("fclose");
+}
+
+static PaHostApiIndex find_host_api(const char *name)
+{
+	PaHostApiIndex count;
+
+	if (!name || !*name)
+		return Pa_GetDefaultHostApi();
+	count = Pa_GetHostApiCount();
+	for (PaHostApiIndex i = 0; i < count; i++) {
+		if (strcmp(Pa_GetHostApiInfo(i)->name, name) == 0)
+			return i;
+	}
+	fprintf(stderr, "PortAudio: no host API named \"%s\"\n", name);
+	return -1;
+}
+
+/*
+ * find_device() - look up a device by name within a host API
+ * @name: device name, or NULL or "" for the host API's default device
+ * @hint: device index where the device was found last time, or paNoDevice
+ */
+static PaDeviceIndex find_device(PaHostApiIndex host_api, const char *name,
+				 PaDeviceIndex hint, bool input)
+{
+	const PaHostApiInfo *api_info = Pa_GetHostApiInfo(host_api);
+	const PaDeviceInfo *info;
+
+	if (!name || !*name) {
+		if (input)
+			return api_info->defaultInputDevice;
+		else
+			return api_info->defaultOutputDevice;
+	}
+
+	if (hint >= 0 && hint < Pa_GetDeviceCount()) {
+		info = Pa_GetDeviceInfo(hint);
+		if (info->hostApi == host_api && strcmp(info->name, name) == 0)
+			return hint;
+	}
+
+	for (int i = 0; i < api_info->deviceCount; i++) {
+		PaDeviceIndex device;
+
+		device = Pa_HostApiDeviceIndexToDeviceIndex(host_api, i);
+		info = Pa_GetDeviceInfo(device);
+		if (strcmp(info->name, name) != 0)
+			continue;
+		if ((input ? info->maxInputChannels : info->maxOutputChannels) > 0)
+			return device;
+	}
+	fprintf(stderr, "PortAudio: no %s device named \"%s\" in %s\n",
+		input ? "input" : "output", name, api_info->name);
+	return paNoDevice;
+}
+
+/*
+ * select_devices() - pick the devices, their latencies, and the buffer size
+ *
+ * Explicit parameters take precedence over the cache. The cache is rewritten if
+ * the selection changed.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+static int select_devices(const struct sofi_init_parameters *params,
+			  PaStreamParameters *input_params,
+			  PaStreamParameters *output_params,
+			  unsigned long *frames_per_buffer)
+{
+	struct device_cache cache, old_cache;
+	const char *host_api_name = params->host_api;
+	const char *input_name = params->input_device;
+	const char *output_name = params->output_device;
+	PaHostApiIndex host_api;
+
+	if (params->device_cache) {
+		read_device_cache(params->device_cache, &cache);
+	} else {
+		memset(&cache, 0, sizeof(cache));
+		cache.input_index = cache.output_index = paNoDevice;
+	}
+	old_cache = cache;
+
+	/* A cached selection is only good for the host API it was made in. */
+	if (!host_api_name)
+		host_api_name = cache.host_api;
+	else if (strcmp(host_api_name, cache.host_api) != 0)
+		cache.input[0] = cache.output[0] = '\0';
+	if (!input_name)
+		input_name = cache.input;
+	if (!output_name)
+		output_name = cache.output;
+
+	host_api = find_host_api(host_api_name);
+	if (host_api < 0)
+		return -1;
+	snprintf(cache.host_api, sizeof(cache.host_api), "%s",
+		 Pa_GetHostApiInfo(host_api)->name);
+
+	if (params->receiver) {
+		const PaDeviceInfo *info;
+		PaDeviceIndex device;
+
+		device = find_device(host_api, input_name, cache.input_index, true);
+		if (device == paNoDevice)
+			return -1;
+		info = Pa_GetDeviceInfo(device);
+		if (params->input_latency > 0.)
+			cache.input_latency = params->input_latency;
+		else if (device != cache.input_index || cache.input_latency <= 0.)
+			cache.input_latency = info->defaultLowInputLatency;
+		snprintf(cache.input, sizeof(cache.input), "%s", info->name);
+		cache.input_index = device;
+		input_params->device = device;
+		input_params->suggestedLatency = cache.input_latency;
+	}
+	if (params->sender) {
+		const PaDeviceInfo *info;
+		PaDeviceIndex device;
+
+		device = find_device(host_api, output_name, cache.output_index, false);
+		if (device == paNoDevice)
+			return -1;
+		info = Pa_GetDeviceInfo(device);
+		if (params->output_latency > 0.)
+			cache.output_latency = params->output_latency;
+		else if (device != cache.output_index || cache.output_latency <= 0.)
+			cache.output_latency = info->defaultLowOutputLatency;
+		snprintf(cache.output, sizeof(cache.output), "%s", info->name);
+		cache.output_index = device;
+		output_params->device = device;
+		output_params->suggestedLatency = cache.output_latency;
+	}
+	if (params->frames_per_buffer != paFramesPerBufferUnspecified)
+		cache.frames_per_buffer = params->frames_per_buffer;
+	*frames_per_buffer = cache.frames_per_buffer;
+
+	if (params->device_cache &&
+	    memcmp(&cache, &old_cache, sizeof(cache)) != 0)
+		write_device_cache(params->device_cache, &cache);
+
+	debug_printf(1, "Host API:\t\t%s\n", cache.host_api);
+	if (params->receiver)
+		debug_printf(1, "Input device:\t\t%s\n", cache.input);
+	if (params->sender)
+		debug_printf(1, "Output device:\t\t%s\n", cache.output);
+	return 0;
+}
+
+/*
+ * Try the modem's rate first (unless asked not to), then the device's native
+ * rate, since opening a device at any other rate either fails or makes the OS
+ * resample behind our back.
+ */
+static long negotiate_rate(const struct sofi_init_parameters *params,
+			   const PaStreamParameters *stream_params, bool input)
+{
+	const PaStreamParameters *in = input ? stream_params : NULL;
+	const PaStreamParameters *out = input ? NULL : stream_params;
+	double rates[2];
+	int n = 0;
+
+	if (!params->native_rate)
+		rates[n++] = params->sample_rate;
+	rates[n++] = Pa_GetDeviceInfo(stream_params->device)->defaultSampleRate;
+
+	for (int i = 0; i < n; i++) {
+		if (Pa_IsFormatSupported(in, out, rates[i]) == paFormatIsSupported)
+			return (long)rates[i];
+		debug_printf(1, "%ld Hz is not supported for %s\n", (long)rates[i],
+			     input ? "input" : "output");
+	}
+	fprintf(stderr, "PortAudio: no usable sample rate for the %s device\n",
+		input ? "input" : "output");
+	return -1;
+}
+
+/*
+ * stream_parameters() - fill in the PortAudio parameters for our streams
+ *
+ * Return: 0 on success, -1 on error.
+ */
+static int stream_parameters(const struct sofi_init_parameters *params,
+			     PaStreamParameters *input_params,
+			     PaStreamParameters *output_params,
+			     unsigned long *frames_per_buffer)
+{
+	if (select_devices(params, input_params, output_params,
+			   frames_per_buffer))
+		return -1;
+	if (params->receiver) {
+		input_params->channelCount = params->input_channels;
+		input_params->sampleFormat = int16_samples ? paInt16 : paFloat32;
+		input_params->hostApiSpecificStreamInfo = NULL;
+	}
+	if (params->sender) {
+		output_params->channelCount = params->output_channels;
+		output_params->sampleFormat = int16_samples ? paInt16 : paFloat32;
+		output_params->hostApiSpecificStreamInfo = NULL;
+	}
+	if (params->receiver) {
+		input_rate = negotiate_rate(params, input_params, true);
+		if (input_rate == -1)
+			return -1;
+	}
+	if (params->sender) {
+		output_rate = negotiate_rate(params, output_params, false);
+		if (output_rate == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* Every tone has to make it through both devices. */
+static int check_freqs(const struct sofi_init_parameters *params)
+{
+	long rate;
+
+	if (receiver && sender)
+		rate = input_rate < output_rate ? input_rate : output_rate;
+	else
+		rate = receiver ? input_rate : output_rate;
+	for (int i = 0; i < (1 << params->symbol_width); i++) {
+		if (params->symbol_freqs[i] >= RESAMPLER_PASSBAND * rate) {
+			fprintf(stderr, "%f Hz is too high for a %ld Hz device\n",
+				params->symbol_freqs[i], rate);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Open a stream in one direction and start it. */
+static int open_stream(PaStream **s, const PaStreamParameters *input_params,
+		       const PaStreamParameters *output_params, long rate,
+		       unsigned long frames_per_buffer,
+		       PaStreamCallback *callback, void *arg)
+{
+	const char *dir = input_params ? "input" : "output";
+	PaError err;
+
+	err = Pa_OpenStream(s, input_params, output_params, rate,
+			    frames_per_buffer, paClipOff, callback, arg);
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: opening %s stream failed: %s\n",
+			dir, Pa_GetErrorText(err));
+		return -1;
+	}
+	err = Pa_StartStream(*s);
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: starting %s stream failed: %s\n",
+			dir, Pa_GetErrorText(err));
+		Pa_CloseStream(*s);
+		return -1;
+	}
+	return 0;
+}
+
+static void close_stream(PaStream *s)
+{
+	PaError err;
+
+	err = Pa_StopStream(s);
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: stopping stream failed: %s\n",
+			Pa_GetErrorText(err));
+	}
+	err = Pa_CloseStream(s);
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: closing stream failed: %s\n",
+			Pa_GetErrorText(err));
+	}
+}
+
+static void free_buffers(void)
+{
+	free(modem_buffer_ptr);
+	free(capture_chunk);
+	free(resampled_chunk);
+	free(channel_in);
+	free(channel_out);
+	modem_buffer_ptr = capture_chunk = resampled_chunk = NULL;
+	channel_in = channel_out = NULL;
+	free_front_end(&param_blocks[0]);
+	free_front_end(&param_blocks[1]);
+}
+
+static void *tap_loop(void *arg)
+{
+	int ret, err;
+	(void)arg;
+
+	for (;; pthread_testcancel()) {
+		ret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		assert(ret == 0);
+		err = tap_flush(&tap);
+		ret = pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		assert(ret == 0);
+		if (err) {
+			fprintf(stderr, "sofi: recording stopped\n");
+			return (void *)-1;
+		}
+		Pa_Sleep(TAP_PERIOD);
+	}
+	return (void *)0;
+}
+
+static int start_recording(const struct sofi_init_parameters *params)
+{
+	int ret;
+
+	if (tap_open(&tap, params->record_path, params->record_limit))
+		return -1;
+	ret = pthread_create(&tap_thread, NULL, tap_loop, NULL);
+	if (ret) {
+		errno = ret;
+		perror("pthread_create");
+		tap_close(&tap);
+		return -1;
+	}
+	recording = true;
+	return 0;
+}
+
+/* This must only be called once the streams are stopped. */
+static void stop_recording(void)
+{
+	int ret;
+
+	if (!recording)
+		return;
+	recording = false;
+	ret = pthread_cancel(tap_thread);
+	assert(ret == 0);
+	ret = pthread_join(tap_thread, NULL);
+	assert(ret == 0);
+	if (stat_read(&tap.dropped))
+		debug_printf(1, "%lu chunks missing from the recording\n",
+			     stat_read(&tap.dropped));
+	tap_close(&tap);
+}
+
+static void free_state(void)
+{
+	free(sender_buffer_ptr);
+	free(receiver_buffer_ptr);
+	free(window_buffer);
+	sender_buffer_ptr = receiver_buffer_ptr = window_buffer = NULL;
+	free_buffers();
+}
+
+/*
+ * Set up the state and buffers that don't depend on PortAudio: everything that
+ * sofi_init() does before it opens the streams and starts the threads.
+ */
+static int init_state(const struct sofi_init_parameters *params)
+{
+	int ret;
+
+	sample_rate = params->sample_rate;
+	debug_level = params->debug_level;
+	sender = params->sender;
+	receiver = params->receiver;
+	int16_samples = params->sample_format == SOFI_SAMPLE_INT16;
+	input_channels = params->input_channels;
+	combining = params->combining;
+	if (input_channels < 1 || input_channels > MAX_INPUT_CHANNELS) {
+		fprintf(stderr, "sofi_init: input channels must be between 1 and %d\n",
+			MAX_INPUT_CHANNELS);
+		return -1;
+	}
+	output_channels = params->output_channels;
+	if (output_channels < 1 || output_channels > MAX_OUTPUT_CHANNELS) {
+		fprintf(stderr, "sofi_init: output channels must be between 1 and %d\n",
+			MAX_OUTPUT_CHANNELS);
+		return -1;
+	}
+	for (int ch = 0; ch < output_channels; ch++) {
+		ret = pthread_mutex_init(&send_locks[ch], NULL);
+		assert(ret == 0);
+	}
+
+	hamming_init();
+	sine_init();
+	reset_channels();
+	reset_tracker(&clock_tracker);
+	reset_tracker(&freq_tracker);
+	reset_agc();
+	clipped_samples = 0;
+	capture_overflows = 0;
+	capture_clock.seq = capture_clock.frames = 0;
+	capture_clock.gap_end = capture_clock.gap = 0;
+	capture_clock.time = 0.;
+	capture_consumed = 0;
+	stats = (struct sofi_stats){0};
+
+	/* Initialize callback data and receiver window buffer. */
+	if (params->sender) {
+		sender_buffer_ptr = malloc(output_channels * SENDER_BUFFER_SIZE *
+					   sizeof(struct raw_message));
+		if (!sender_buffer_ptr) {
+			perror("malloc");
+			goto err;
+		}
+		for (int ch = 0; ch < output_channels; ch++) {
+			memset(&data.sender[ch], 0, sizeof(data.sender[ch]));
+			PaUtil_InitializeRingBuffer(&data.sender[ch].buffer,
+						    sizeof(struct raw_message),
+						    SENDER_BUFFER_SIZE,
+						    (struct raw_message *)sender_buffer_ptr +
+						    ch * SENDER_BUFFER_SIZE);
+		}
+	}
+	if (params->receiver) {
+		receiver_buffer_ptr = malloc(RECEIVER_BUFFER_SIZE * frame_size());
+		if (!receiver_buffer_ptr) {
+			perror("malloc");
+			goto err;
+		}
+		PaUtil_InitializeRingBuffer(&data.receiver.buffer,
+					    frame_size(), RECEIVER_BUFFER_SIZE,
+					    receiver_buffer_ptr);
+		window_buffer = malloc(RECEIVER_BUFFER_SIZE * frame_size());
+		if (!window_buffer) {
+			perror("malloc");
+			goto err;
+		}
+
+		/* The front-end never upsamples. */
+		modem_buffer_ptr = malloc(RECEIVER_BUFFER_SIZE * frame_size());
+		capture_chunk = malloc(CAPTURE_CHUNK * frame_size());
+		resampled_chunk = malloc((CAPTURE_CHUNK + 1) * frame_size());
+		channel_in = malloc(CAPTURE_CHUNK * sample_size());
+		channel_out = malloc((CAPTURE_CHUNK + 1) * sample_size());
+		if (!modem_buffer_ptr || !capture_chunk || !resampled_chunk ||
+		    !channel_in || !channel_out) {
+			perror("malloc");
+			goto err;
+		}
+		PaUtil_InitializeRingBuffer(&modem_buffer, frame_size(),
+					    RECEIVER_BUFFER_SIZE,
+					    modem_buffer_ptr);
+	}
+
+	return 0;
+
+err:
+	free_state();
+	return -1;
+}
+
+int sofi_init(const struct sofi_init_parameters *params)
+{
+	PaError err;
+	int ret;
+	PaStreamParameters input_params, output_params;
+	unsigned long frames_per_buffer;
+	const struct modem_params *p;
+
+	if (init_state(params))
+		return -1;
+
+	/* Initialize PortAudio. */
+	err = Pa_Initialize();
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: initialization failed: %s\n",
+			Pa_GetErrorText(err));
+		goto err;
+	}
+
+	/* Pick the parameters for the streams. */
+	if (stream_parameters(params, &input_params, &output_params,
+			      &frames_per_buffer))
+		goto terminate;
+	if (check_freqs(params))
+		goto terminate;
+
+	active_params = 0;
+	if (set_params(&param_blocks[0], params))
+		goto terminate;
+	receiver_params = &param_blocks[0];
+	p = &param_blocks[0];
+	rate_reset();
+
+	replaying = false;
+	if (params->record_path && start_recording(params))
+		goto terminate;
+
+	/*
+	 * Open a stream in each direction, so that capture and playback can be
+	 * on different cards and the sender never holds up the receiver.
+	 */
+	transmitting = false;
+	if (params->receiver &&
+	    open_stream(&input_stream, &input_params, NULL, input_rate,
+			frames_per_buffer, input_callback, &data))
+		goto stop_tap;
+	if (params->sender &&
+	    open_stream(&output_stream, NULL, &output_params, output_rate,
+			frames_per_buffer, output_callback, &data))
+		goto close_input;
+
+	/* Start the reciever thread and the thread that prints its trace. */
+	if (params->receiver) {
+		if (trace_ring_init(&receiver_trace))
+			goto close_output;
+		ret = pthread_create(&trace_thread, NULL, trace_loop, NULL);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			goto free_trace;
+		}
+		ret = pthread_create(&receiver_thread, NULL, receiver_loop,
+				     &data.receiver.buffer);
+		if (ret) {
+			errno = ret;
+			perror("pthread_create");
+			goto stop_trace;
+		}
+	}
+
+	debug_printf(1,
+		     "Sending:\t\t%s (%d channels at %ld Hz)\n"
+		     "Receiving:\t\t%s (%d channels at %ld Hz)\n"
+		     "Frames per buffer:\t%lu\n",
+		     params->sender ? "yes" : "no", output_channels, output_rate,
+		     params->receiver ? "yes" : "no", input_channels, input_rate,
+		     frames_per_buffer);
+	dump_params(p);
+
+	return 0;
+
+stop_trace:
+	ret = pthread_cancel(trace_thread);
+	assert(ret == 0);
+	ret = pthread_join(trace_thread, NULL);
+	assert(ret == 0);
+free_trace:
+	trace_ring_free(&receiver_trace);
+close_output:
+	if (params->sender)
+		close_stream(output_stream);
+close_input:
+	if (params->receiver)
+		close_stream(input_stream);
+stop_tap:
+	stop_recording();
+terminate:
+	err = Pa_Terminate();
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: termination failed: %s\n",
+			Pa_GetErrorText(err));
+	}
+err:
+	free_state();
+	return -1;
+}
+
+/*
+ * Buffer size calibration. Each candidate size is run for a few seconds with a
+ * callback that does about as much work as the real one, and the smallest size
+ * that gets through without any over- or underflows wins.
+ */
+#define CALIBRATION_MIN_FRAMES 32UL
+#define CALIBRATION_MAX_FRAMES 8192UL
+#define CALIBRATION_WARMUP 0.5f /* seconds */
+#define CALIBRATION_DURATION 2.f /* seconds */
+
+struct calibration_data {
+	long rate;
+	int channels;
+	unsigned long frames;
+	unsigned long xruns;
+	float phase;
+	float sum;
+	uint32_t nco_phase;
+	int64_t nco_sum;
+};
+
+static int calibration_callback(const void *input_buffer, void *output_buffer,
+				unsigned long frames_per_buffer,
+				const PaStreamCallbackTimeInfo *time_info,
+				PaStreamCallbackFlags status_flags, void *arg)
+{
+	struct calibration_data *cal = arg;
+	const float *in = input_buffer;
+	const int16_t *in16 = input_buffer;
+	uint32_t step = nco_step(1000.f, cal->rate);
+	float sum = 0.f;
+	(void)time_info;
+
+	if (cal->frames >= CALIBRATION_WARMUP * cal->rate &&
+	    (status_flags & (paInputUnderflow | paInputOverflow |
+			     paOutputUnderflow | paOutputOverflow)))
+		cal->xruns++;
+	cal->frames += frames_per_buffer;
+
+	/* Synthesize and correlate a tone, but keep quiet. */
+	if (output_buffer)
+		memset(output_buffer, 0,
+		       frames_per_buffer * cal->channels * sample_size());
+	for (unsigned long i = 0; i < frames_per_buffer; i++) {
+		if (int16_samples) {
+			int16_t tone = nco_sin(cal->nco_phase);
+
+			if (input_buffer)
+				cal->nco_sum += (int32_t)in16[i * cal->channels] * tone;
+			cal->nco_phase += step;
+		} else {
+			float tone = sinf(cal->phase);
+
+			if (input_buffer)
+				sum += in[i * cal->channels] * tone;
+			cal->phase += 2.f * M_PI * 1000.f / cal->rate;
+			while (cal->phase >= 2.f * M_PI)
+				cal->phase -= 2.f * M_PI;
+		}
+	}
+	cal->sum += sum;
+	return paContinue;
+}
+
+static int calibrate_frames(const struct sofi_init_parameters *params,
+			    PaStreamParameters *input_params,
+			    PaStreamParameters *output_params,
+			    unsigned long frames_per_buffer)
+{
+	struct calibration_data in_cal = {
+		input_rate, params->input_channels, 0, 0, 0.f, 0.f, 0, 0
+	};
+	struct calibration_data out_cal = {
+		output_rate, params->output_channels, 0, 0, 0.f, 0.f, 0, 0
+	};
+	PaStream *in_stream = NULL, *out_stream = NULL;
+	PaError err = paNoError;
+	unsigned long xruns;
+
+	/* Both directions run at once, on their own streams, like sofi_init. */
+	if (params->receiver)
+		err = Pa_OpenStream(&in_stream, input_params, NULL, input_rate,
+				    frames_per_buffer, paClipOff,
+				    calibration_callback, &in_cal);
+	if (err == paNoError && params->sender)
+		err = Pa_OpenStream(&out_stream, NULL, output_params,
+				    output_rate, frames_per_buffer, paClipOff,
+				    calibration_callback, &out_cal);
+	if (err == paNoError && in_stream)
+		err = Pa_StartStream(in_stream);
+	if (err == paNoError && out_stream)
+		err = Pa_StartStream(out_stream);
+	if (err == paNoError)
+		Pa_Sleep(1000.f * (CALIBRATION_WARMUP + CALIBRATION_DURATION));
+	if (out_stream) {
+		if (Pa_IsStreamActive(out_stream) == 1 && err == paNoError)
+			err = Pa_StopStream(out_stream);
+		Pa_CloseStream(out_stream);
+	}
+	if (in_stream) {
+		if (Pa_IsStreamActive(in_stream) == 1 && err == paNoError)
+			err = Pa_StopStream(in_stream);
+		Pa_CloseStream(in_stream);
+	}
+	if (err != paNoError) {
+		debug_printf(1, "%lu frames: %s\n", frames_per_buffer,
+			     Pa_GetErrorText(err));
+		return -1;
+	}
+	xruns = in_cal.xruns + out_cal.xruns;
+	debug_printf(1, "%lu frames: %lu xruns\n", frames_per_buffer, xruns);
+	return xruns ? -1 : 0;
+}
+
+int sofi_calibrate(const struct sofi_init_parameters *params,
+		   unsigned long *frames_per_buffer)
+{
+	struct sofi_init_parameters cal_params = *params;
+	PaStreamParameters input_params, output_params;
+	unsigned long frames;
+	PaError err;
+	int ret = -1;
+
+	sample_rate = params->sample_rate;
+	debug_level = params->debug_level;
+	int16_samples = params->sample_format == SOFI_SAMPLE_INT16;
+	sine_init();
+
+	err = Pa_Initialize();
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: initialization failed: %s\n",
+			Pa_GetErrorText(err));
+		return -1;
+	}
+
+	/* Don't let a previously calibrated size stick. */
+	cal_params.frames_per_buffer = paFramesPerBufferUnspecified;
+	cal_params.device_cache = NULL;
+	if (stream_parameters(&cal_params, &input_params, &output_params,
+			      &frames))
+		goto terminate;
+
+	for (frames = CALIBRATION_MIN_FRAMES; frames <= CALIBRATION_MAX_FRAMES;
+	     frames *= 2) {
+		if (calibrate_frames(params, &input_params, &output_params,
+				     frames) == 0) {
+			*frames_per_buffer = frames;
+			ret = 0;
+			break;
+		}
+	}
+	if (ret) {
+		fprintf(stderr, "sofi_calibrate: no stable buffer size up to %lu frames\n",
+			CALIBRATION_MAX_FRAMES);
+		goto terminate;
+	}
+
+	/* Remember the result along with the device selection. */
+	if (params->device_cache) {
+		cal_params.device_cache = params->device_cache;
+		cal_params.frames_per_buffer = *frames_per_buffer;
+		if (stream_parameters(&cal_params, &input_params,
+				      &output_params, &frames))
+			ret = -1;
+	}
+
+terminate:
+	err = Pa_Terminate();
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: termination failed: %s\n",
+			Pa_GetErrorText(err));
+	}
+	return ret;
+}
+
+void sofi_destroy(void)
+{
+	PaError err;
+	int ret;
+
+	if (receiver) {
+		ret = pthread_cancel(receiver_thread);
+		assert(ret == 0);
+		ret = pthread_join(receiver_thread, NULL);
+		assert(ret == 0);
+		ret = pthread_cancel(trace_thread);
+		assert(ret == 0);
+		ret = pthread_join(trace_thread, NULL);
+		assert(ret == 0);
+		trace_drain(&receiver_trace, stderr);
+		trace_ring_free(&receiver_trace);
+	}
+
+	/*
+	 * Wait for any outstanding output to be sent, plus a little extra
+	 * because either PortAudio or ALSA can't be trusted.
+	 */
+	wait_senders_drained();
+	Pa_Sleep(100);
+
+	if (sender)
+		close_stream(output_stream);
+	if (receiver)
+		close_stream(input_stream);
+	stop_recording();
+	err = Pa_Terminate();
+	if (err != paNoError) {
+		fprintf(stderr, "PortAudio: termination failed: %s\n",
+			Pa_GetErrorText(err));
+	}
+	free_state();
+	for (int ch = 0; ch < output_channels; ch++) {
+		ret = pthread_mutex_destroy(&send_locks[ch]);
+		assert(ret == 0);
+	}
+}
+
+int sofi_reconfigure(const struct sofi_init_parameters *params)
+{
+	int next;
+	int ret, err;
+
+	if ((long)params->sample_rate != sample_rate) {
+		fprintf(stderr, "sofi_reconfigure: the sample rate can't be changed\n");
+		return -1;
+	}
+	if (check_freqs(params))
+		return -1;
+
+	lock_senders();
+	pthread_cleanup_push(unlock_senders, NULL);
+
+	/*
+	 * Nothing encoded with the old parameters may still be queued, and the
+	 * receiver may still be demodulating a packet with the block from the
+	 * last reconfiguration, which is the one we're about to overwrite.
+	 */
+	wait_senders_drained();
+	while (receiver && receiver_params != current_params())
+		Pa_Sleep(10);
+
+	next = !active_params;
+	err = set_params(&param_blocks[next], params);
+	if (!err) {
+		PaUtil_WriteMemoryBarrier();
+		active_params = next;
+
+		ret = pthread_mutex_lock(&rate_lock);
+		assert(ret == 0);
+		rate_reset();
+		ret = pthread_mutex_unlock(&rate_lock);
+		assert(ret == 0);
+
+		debug_level = params->debug_level;
+		debug_printf(1, "Reconfigured:\n");
+		dump_params(&param_blocks[next]);
+	}
+
+	pthread_cleanup_pop(1);
+	return err;
+}
+
+void sofi_get_capture_stats(struct sofi_capture_stats *stats)
+{
+	stats->gain = agc_gain;
+	stats->clipped = stat_read(&clipped_samples);
+	stats->overflows = stat_read(&capture_overflows);
+}
+
+static void read_histogram(unsigned long *out, const unsigned long *histogram,
+			   int buckets)
+{
+	for (int i = 0; i < buckets; i++)
+		out[i] = stat_read(&histogram[i]);
+}
+
+static void read_callback_stats(struct sofi_callback_stats *out,
+				const struct sofi_callback_stats *s)
+{
+	out->calls = stat_read(&s->calls);
+	out->underflows = stat_read(&s->underflows);
+	out->overflows = stat_read(&s->overflows);
+	read_histogram(out->load, s->load, SOFI_LOAD_BUCKETS);
+	__atomic_load(&s->max_load, &out->max_load, __ATOMIC_RELAXED);
+}
+
+void sofi_get_stats(struct sofi_stats *out)
+{
+	out->packets_sent = stat_read(&stats.packets_sent);
+	out->packets_received = stat_read(&stats.packets_received);
+	out->crc_failures = stat_read(&stats.crc_failures);
+	out->recv_queue_overflows = stat_read(&stats.recv_queue_overflows);
+	out->capture_high_water = stat_read(&stats.capture_high_water);
+	__atomic_load(&stats.clock_offset, &out->clock_offset, __ATOMIC_RELAXED);
+	__atomic_load(&stats.frequency_offset, &out->frequency_offset,
+		      __ATOMIC_RELAXED);
+	read_callback_stats(&out->input, &stats.input);
+	read_callback_stats(&out->output, &stats.output);
+	read_histogram(out->enqueue_to_air, stats.enqueue_to_air,
+		       SOFI_LATENCY_BUCKETS);
+	read_histogram(out->air_to_delivery, stats.air_to_delivery,
+		       SOFI_LATENCY_BUCKETS);
+	for (int i = 0; i < SOFI_STAGES; i++) {
+		const struct sofi_stage_stats *s = &stats.stages[i];
+
+		out->stages[i].packets = stat_read(&s->packets);
+		__atomic_load(&s->total, &out->stages[i].total, __ATOMIC_RELAXED);
+		__atomic_load(&s->max, &out->stages[i].max, __ATOMIC_RELAXED);
+		read_histogram(out->stages[i].histogram, s->histogram,
+			       SOFI_LATENCY_BUCKETS);
+	}
+	out->capture_ring_size = receiver ? RECEIVER_BUFFER_SIZE : 0;
+	sofi_get_capture_stats(&out->capture);
+}
+
+int sofi_replay(const char *path)
+{
+	struct tap_chunk chunk;
+	void *samples = NULL;
+	size_t size, capacity = 0;
+	ring_buffer_size_t written, n;
+	unsigned long acks;
+	FILE *f;
+	int ret = -1;
+
+	if (!receiver) {
+		fprintf(stderr, "sofi_replay: not running the receiver\n");
+		return -1;
+	}
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	/*
+	 * Wait for an input callback to see the flag, which means the one that
+	 * may have been running has finished, and then have the receiver start
+	 * from scratch, as it did when the recording began.
+	 */
+	acks = replay_acks;
+	replaying = true;
+	PaUtil_FullMemoryBarrier();
+	while (replay_acks == acks)
+		Pa_Sleep(1);
+	restart_receiver = true;
+	while (restart_receiver)
+		Pa_Sleep(10);
+
+	while (fread(&chunk, sizeof(chunk), 1, f) == 1) {
+		/* A recording that wasn't closed is padded with zeroes. */
+		if (chunk.magic == 0)
+			break;
+		if (chunk.magic != TAP_MAGIC) {
+			fprintf(stderr, "sofi_replay: %s is not a recording\n",
+				path);
+			goto out;
+		}
+		size = tap_chunk_size(&chunk);
+		if (chunk.stream != TAP_CAPTURE) {
+			if (fseek(f, size, SEEK_CUR)) {
+				perror("fseek");
+				goto out;
+			}
+			continue;
+		}
+		if ((long)chunk.rate != input_rate ||
+		    chunk.channels != input_channels ||
+		    (chunk.format == SOFI_SAMPLE_INT16) != int16_samples) {
+			fprintf(stderr, "sofi_replay: %s was captured at %" PRIu32 " Hz with %" PRIu16 " channels of another format\n",
+				path, chunk.rate, chunk.channels);
+			goto out;
+		}
+		if (size > capacity) {
+			void *bigger = realloc(samples, size);
+
+			if (!bigger) {
+				perror("realloc");
+				goto out;
+			}
+			samples = bigger;
+			capacity = size;
+		}
+		if (fread(samples, size, 1, f) != 1) {
+			fprintf(stderr, "sofi_replay: %s is truncated\n", path);
+			goto out;
+		}
+
+		/* Feed the receiver as fast as it keeps up. */
+		for (written = 0; written < (ring_buffer_size_t)chunk.frames;) {
+			n = PaUtil_WriteRingBuffer(&data.receiver.buffer,
+						   (char *)samples +
+						   written * frame_size(),
+						   chunk.frames - written);
+			/* The recording's samples count as captured as they are fed. */
+			advance_capture_clock(n, monotonic_time());
+			written += n;
+			if (written < (ring_buffer_size_t)chunk.frames)
+				Pa_Sleep(10);
+		}
+	}
+	if (ferror(f)) {
+		perror("fread");
+		goto out;
+	}
+	ret = 0;
+
+out:
+	replaying = false;
+	free(samples);
+	fclose(f);
+	return ret;
+}
+
+/* Fill in the parameters of the active modulation. */
+static void active_init_params(struct sofi_init_parameters *params)
+{
+	const struct modem_params *p = current_params();
+
+	*params = (struct sofi_init_parameters)DEFAULT_SOFI_INIT_PARAMS;
+	params->sample_rate = sample_rate;
+	params->baud = p->baud;
+	params->recv_window_factor = p->recv_window_factor;
+	params->interpacket_gap_factor = p->interpacket_gap_factor;
+	params->symbol_width = p->symbol_width;
+	memcpy(params->symbol_freqs, p->symbol_freqs,
+	       num_symbols(p) * sizeof(float));
+	params->rate_adaptation = p->rate_adaptation;
+	params->debug_level = debug_level;
+}
+
+/*
+ * The probe plan has 256 tones evenly spaced across the band, sent at a baud of
+ * one tone spacing so that they are all orthogonal. The spacing is rounded down
+ * to a whole number of Hz so that the receiver can decimate.
+ */
+static int probe_params(float min_freq, float max_freq,
+			struct sofi_init_parameters *params)
+{
+	float spacing = floorf((max_freq - min_freq) / 255.f);
+
+	if (min_freq <= 0.f || spacing < 1.f) {
+		fprintf(stderr, "sofi: invalid sounding band %.2f-%.2f Hz\n",
+			min_freq, max_freq);
+		return -1;
+	}
+	active_init_params(params);
+	params->baud = spacing;
+	params->symbol_width = 8;
+	for (int i = 0; i < (1 << 8); i++)
+		params->symbol_freqs[i] = min_freq + spacing * i;
+	params->rate_adaptation = false;
+	return 0;
+}
+
+int sofi_send_probe(float min_freq, float max_freq)
+{
+	struct sofi_init_parameters saved, probe;
+	struct raw_message msg;
+	int ret;
+
+	if (!sender) {
+		fprintf(stderr, "sofi_send_probe: not running the sender\n");
+		return -1;
+	}
+	active_init_params(&saved);
+	if (probe_params(min_freq, max_freq, &probe) || sofi_reconfigure(&probe))
+		return -1;
+
+	/* One more sweep than is recorded covers a late start. */
+	memset(&msg, 0, sizeof(msg));
+	msg.rung = BASE_RUNG;
+	msg.width = 8;
+	msg.control = true;
+	while (msg.len < (SOUNDING_SWEEPS + 1) << 8) {
+		msg.symbols[msg.len] = sounding_tone(msg.len);
+		msg.len++;
+	}
+	ret = pthread_mutex_lock(&send_locks[0]);
+	assert(ret == 0);
+	pthread_cleanup_push(unlock_mutex, &send_locks[0]);
+	while (PaUtil_WriteRingBuffer(&data.sender[0].buffer, &msg, 1) < 1)
+		Pa_Sleep(CHAR_BIT * 1000.f / probe.baud);
+	pthread_cleanup_pop(1);
+
+	/* This waits for the probe to go out. */
+	return sofi_reconfigure(&saved);
+}
+
+/* A window votes for where the probe started if one tone is this far ahead. */
+#define SOUNDING_CLEAR 8.f
+
+static int analyze_sounding(float (*windows)[1 << 8], int window_size,
+			    const struct sofi_init_parameters *probe,
+			    struct sofi_sounding *result)
+{
+	unsigned int votes[1 << 8] = {0};
+	float signal[1 << 8] = {0.f}, noise[1 << 8] = {0.f};
+	/* Step of the sweep that plays each tone, and the first one recorded. */
+	int step[1 << 8];
+	int start = 0;
+
+	for (int n = 0; n < (1 << 8); n++)
+		step[sounding_tone(n)] = n;
+	for (int n = 0; n < SOUNDING_WINDOWS; n++) {
+		int best = 0;
+		float sum = 0.f;
+
+		for (int i = 0; i < (1 << 8); i++) {
+			sum += windows[n][i];
+			if (windows[n][i] > windows[n][best])
+				best = i;
+		}
+		sum -= windows[n][best];
+		if (windows[n][best] > SOUNDING_CLEAR * sum / ((1 << 8) - 1))
+			votes[(step[best] - n) & 0xff]++;
+	}
+	for (int i = 1; i < (1 << 8); i++) {
+		if (votes[i] > votes[start])
+			start = i;
+	}
+	if (!votes[start]) {
+		fprintf(stderr, "sofi_recv_probe: no tone of the probe stood out\n");
+		return -1;
+	}
+	debug_printf(1, "Probe picked up at %.2f Hz (%u of %d windows agree)\n",
+		     probe->symbol_freqs[sounding_tone(start)], votes[start],
+		     SOUNDING_WINDOWS);
+
+	/*
+	 * A tone's strength while it was playing is signal plus noise, and its
+	 * strength while the others were playing is noise, including whatever
+	 * the room smeared into it from them.
+	 */
+	for (int n = 0; n < SOUNDING_WINDOWS; n++) {
+		int tone = sounding_tone(start + n);
+
+		for (int i = 0; i < (1 << 8); i++) {
+			if (i == tone)
+				signal[i] += windows[n][i];
+			else
+				noise[i] += windows[n][i];
+		}
+	}
+	result->baud = probe->baud;
+	for (int i = 0; i < (1 << 8); i++) {
+		float s = signal[i] / SOUNDING_SWEEPS;
+		float n = noise[i] / (SOUNDING_WINDOWS - SOUNDING_SWEEPS);
+
+		result->freqs[i] = probe->symbol_freqs[i];
+		result->level[i] = 2.f * sqrtf(fmaxf(s - n, 0.f)) / window_size;
+		result->snr[i] = 10.f * log10f(fmaxf(s - n, 1e-12f) /
+					       fmaxf(n, 1e-12f));
+	}
+	return 0;
+}
+
+int sofi_recv_probe(float min_freq, float max_freq, double timeout,
+		    struct sofi_sounding *result)
+{
+	struct sofi_init_parameters saved, probe;
+	float (*windows)[1 << 8];
+	struct timespec ts;
+	double deadline;
+	int window_size, ret, err = 0;
+
+	if (!receiver) {
+		fprintf(stderr, "sofi_recv_probe: not running the receiver\n");
+		return -1;
+	}
+	windows = malloc(SOUNDING_WINDOWS * sizeof(*windows));
+	if (!windows) {
+		perror("malloc");
+		return -1;
+	}
+	active_init_params(&saved);
+	if (probe_params(min_freq, max_freq, &probe) ||
+	    sofi_reconfigure(&probe)) {
+		free(windows);
+		return -1;
+	}
+	window_size = (int)rung_symbol_frames(current_params(),
+					      current_params()->rate, -1);
+
+	deadline = monotonic_time() + timeout;
+	if (deadline != INFINITY)
+		realtime_deadline(deadline, &ts);
+
+	ret = pthread_mutex_lock(&sounding_lock);
+	assert(ret == 0);
+	sounding_windows = windows;
+	sounding_len = 0;
+	while (sounding_len < SOUNDING_WINDOWS) {
+		if (deadline == INFINITY) {
+			ret = pthread_cond_wait(&sounding_cond, &sounding_lock);
+		} else if (deadline <= monotonic_time()) {
+			err = -1;
+			break;
+		} else {
+			ret = pthread_cond_timedwait(&sounding_cond,
+						     &sounding_lock, &ts);
+			if (ret == ETIMEDOUT)
+				continue;
+		}
+		assert(ret == 0);
+	}
+	sounding_windows = NULL;
+	ret = pthread_mutex_unlock(&sounding_lock);
+	assert(ret == 0);
+
+	/* The probe plan is no good for anything else, heard or not. */
+	if (sofi_reconfigure(&saved))
+		err = -1;
+	else if (err)
+		fprintf(stderr, "sofi_recv_probe: timed out waiting for the probe\n");
+	else
+		err = analyze_sounding(windows, window_size, &probe, result);
+	free(windows);
+	return err;
+}
+
+/*
+ * The receiver only hears tones above CARRIER_AMPLITUDE, so a plan leaves some
+ * headroom above it for fading.
+ */
+#define PLAN_MIN_LEVEL (2.f * CARRIER_AMPLITUDE)
+
+/*
+ * Whether the receiver can pick up a carrier at this baud. The detector rate
+ * goes up as far as the sample rate to give the listen window MIN_RECV_WINDOW
+ * samples, so the window has to hold that many at the sample rate.
+ */
+static bool plan_detectable(const struct sofi_init_parameters *params,
+			    float baud)
+{
+	return params->recv_window_factor / baud * params->sample_rate >=
+	       MIN_RECV_WINDOW;
+}
+
+/*
+ * A plan with baud B can only use tones that are multiples of B apart, and a
+ * tone's SNR drops by 10 log10(B / probe baud) from what the probe measured
+ * because each symbol is that much shorter. For every symbol width and every
+ * multiple of the probe baud, take the best tones on each comb of the probe's
+ * tones at that spacing, and keep the fastest plan whose tones all clear
+ * min_snr.
+ */
+int sofi_select_plan(const struct sofi_sounding *sounding, float min_snr,
+		     struct sofi_init_parameters *params)
 {
-	PaError err;
-	int ret;
-	PaStreamParameters input_params, output_params;
+	int order[1 << 8], best_tones[1 << 8], tones[1 << 8];
+	int best_width = 0, best_step = 0;
+	float best_rate = 0.f;
 
-	sample_rate = params->sample_rate;
-	baud = params->baud;
-	recv_window_factor = params->recv_window_factor;
-	interpacket_gap_factor = params->interpacket_gap_factor;
-	symbol_width = params->symbol_width;
-	memcpy(symbol_freqs, params->symbol_freqs,
-	       num_symbols() * sizeof(float));
-	debug_level = params->debug_level;
+	/* Tones from best to worst. */
+	for (int i = 0; i < (1 << 8); i++) {
+		int j = i;
 
-	/* Initialize callback data and receiver window buffer. */
-	if (params->sender) {
-		sender_buffer_ptr = malloc(SENDER_BUFFER_SIZE * sizeof(struct raw_message));
-		if (!sender_buffer_ptr) {
-			perror("malloc");
-			goto err;
-		}
-		PaUtil_InitializeRingBuffer(&data.sender.buffer,
-					    sizeof(struct raw_message),
-					    SENDER_BUFFER_SIZE,
-					    sender_buffer_ptr);
-		data.sender.phase = 0.f;
-	}
-	if (params->receiver) {
-		receiver_buffer_ptr = malloc(RECEIVER_BUFFER_SIZE * sizeof(float));
-		if (!receiver_buffer_ptr) {
-			perror("malloc");
-			goto err;
-		}
-		PaUtil_InitializeRingBuffer(&data.receiver.buffer,
-					    sizeof(float), RECEIVER_BUFFER_SIZE,
-					    receiver_buffer_ptr);
-		window_buffer = malloc(RECEIVER_BUFFER_SIZE * sizeof(float));
-		if (!window_buffer) {
-			perror("malloc");
-			goto err;
+		while (j > 0 && sounding->snr[order[j - 1]] < sounding->snr[i]) {
+			order[j] = order[j - 1];
+			j--;
 		}
+		order[j] = i;
 	}
 
-	/* Initialize PortAudio. */
-	err = Pa_Initialize();
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: initialization failed: %s\n",
-			Pa_GetErrorText(err));
-		goto err;
-	}
+	for (int width = 1; width <= 8; width *= 2) {
+		int n = 1 << width;
 
-	/* Pick the parameters for the stream. */
-	if (params->receiver) {
-		input_params.device = Pa_GetDefaultInputDevice();
-		input_params.channelCount = 1;
-		input_params.sampleFormat = paFloat32;
-		input_params.suggestedLatency =
-			Pa_GetDeviceInfo(input_params.device)->defaultLowInputLatency;
-		input_params.hostApiSpecificStreamInfo = NULL;
-	}
-	if (params->sender) {
-		output_params.device = Pa_GetDefaultOutputDevice();
-		output_params.channelCount = 1;
-		output_params.sampleFormat = paFloat32;
-		output_params.suggestedLatency =
-			Pa_GetDeviceInfo(output_params.device)->defaultLowOutputLatency;
-		output_params.hostApiSpecificStreamInfo = NULL;
-	}
-
-	/* Open a stream and start it. */
-	err = Pa_OpenStream(&stream,
-			    params->receiver ? &input_params : NULL,
-			    params->sender ? &output_params : NULL,
-			    sample_rate, paFramesPerBufferUnspecified,
-			    paClipOff, sofi_callback, &data);
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: opening stream failed: %s\n",
-			Pa_GetErrorText(err));
-		goto terminate;
-	}
-	err = Pa_StartStream(stream);
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: starting stream failed: %s\n",
-			Pa_GetErrorText(err));
-		goto close_stream;
-	}
+		for (int step = 1; (n - 1) * step < (1 << 8); step++) {
+			float loss = 10.f * log10f((float)step);
+			float rate = width * step * sounding->baud;
+			float best_worst = -INFINITY;
 
-	/* Start the reciever thread. */
-	if (params->receiver) {
-		receiver = true;
-		ret = pthread_create(&receiver_thread, NULL, receiver_loop,
-				     &data.receiver.buffer);
-		if (ret) {
-			errno = ret;
-			perror("pthread_create");
-			goto stop_stream;
+			if (rate <= best_rate)
+				continue;
+			for (int comb = 0; comb < step; comb++) {
+				int count = 0;
+
+				for (int k = 0; k < (1 << 8) && count < n; k++) {
+					if (sounding->snr[order[k]] - loss < min_snr)
+						break;
+					if (sounding->level[order[k]] < PLAN_MIN_LEVEL)
+						continue;
+					if (order[k] % step == comb)
+						tones[count++] = order[k];
+				}
+				/* Of the combs that work, take the strongest. */
+				if (count < n ||
+				    sounding->snr[tones[n - 1]] <= best_worst ||
+				    !plan_detectable(params, step * sounding->baud))
+					continue;
+				best_worst = sounding->snr[tones[n - 1]];
+				best_rate = rate;
+				best_width = width;
+				best_step = step;
+				memcpy(best_tones, tones, n * sizeof(int));
+			}
 		}
 	}
+	if (!best_width) {
+		fprintf(stderr, "sofi_select_plan: not enough tones reach %.1f dB\n",
+			min_snr);
+		return -1;
+	}
 
-	debug_printf(1,
-		     "Sending:\t\t%s\n"
-		     "Receiving:\t\t%s\n"
-		     "Sample rate:\t\t%ld Hz\n"
-		     "Baud:\t\t\t%.2f symbols/sec, %d samples, %.4f seconds\n"
-		     "Window:\t\t\t%d samples, %.4f seconds\n"
-		     "Interpacket gap:\t%d samples, %.4f seconds\n",
-		     params->sender ? "yes" : "no",
-		     params->receiver ? "yes" : "no",
-		     sample_rate,
-		     baud, (int)((float)sample_rate / baud), 1.f / baud,
-		     receiver_window(), receiver_window() / (float)sample_rate,
-		     (int)(interpacket_gap() * sample_rate), interpacket_gap());
-	debug_printf(1, "Frequencies:\t\t");
-	for (int i = 0; i < num_symbols(); i++)
-		debug_printf(1, "%s%.2f Hz", (i > 0) ? ", " : "", symbol_freqs[i]);
-	debug_printf(1, "\n");
+	/* Symbols go in order of frequency. */
+	for (int i = 1; i < (1 << best_width); i++) {
+		for (int j = i; j > 0 && best_tones[j - 1] > best_tones[j]; j--) {
+			int tmp = best_tones[j];
 
+			best_tones[j] = best_tones[j - 1];
+			best_tones[j - 1] = tmp;
+		}
+	}
+	params->baud = best_step * sounding->baud;
+	params->symbol_width = best_width;
+	for (int i = 0; i < (1 << best_width); i++)
+		params->symbol_freqs[i] = sounding->freqs[best_tones[i]];
 	return 0;
+}
 
-stop_stream:
-	err = Pa_StopStream(stream);
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: stopping stream failed: %s\n",
-			Pa_GetErrorText(err));
-	}
-close_stream:
-	err = Pa_CloseStream(stream);
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: closing stream failed: %s\n",
-			Pa_GetErrorText(err));
+int sofi_write_plan(const char *path, const struct sofi_init_parameters *params)
+{
+	FILE *file;
+
+	file = fopen(path, "w");
+	if (!file) {
+		perror("fopen");
+		return -1;
 	}
-terminate:
-	err = Pa_Terminate();
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: termination failed: %s\n",
-			Pa_GetErrorText(err));
+	fprintf(file, "baud=%f\n", params->baud);
+	fprintf(file, "symbol_width=%d\n", params->symbol_width);
+	fprintf(file, "frequencies=");
+	for (int i = 0; i < (1 << params->symbol_width); i++)
+		fprintf(file, "%s%f", i ? "," : "", params->symbol_freqs[i]);
+	fprintf(file, "\n");
+	if (fclose(file)) {
+		perror("fclose");
+		return -1;
 	}
-err:
-	free(sender_buffer_ptr);
-	free(receiver_buffer_ptr);
-	free(window_buffer);
-	return -1;
+	return 0;
 }
 
-void sofi_destroy(void)
+int sofi_read_plan(const char *path, struct sofi_init_parameters *params)
 {
-	PaError err;
-	int ret;
+	char line[4096];
+	float baud = 0.f, freqs[1 << 8];
+	int width = 0, n = 0;
+	FILE *file;
 
-	if (receiver) {
-		ret = pthread_cancel(receiver_thread);
-		assert(ret == 0);
-		ret = pthread_join(receiver_thread, NULL);
-		assert(ret == 0);
+	file = fopen(path, "r");
+	if (!file) {
+		perror("fopen");
+		return -1;
 	}
+	while (fgets(line, sizeof(line), file)) {
+		char *value = strchr(line, '=');
 
-	/*
-	 * Wait for any outstanding output to be sent, plus a little extra
-	 * because either PortAudio or ALSA can't be trusted.
-	 */
-	while (PaUtil_GetRingBufferReadAvailable(&data.sender.buffer) > 0)
-		Pa_Sleep(CHAR_BIT * 1000.f / baud);
-	Pa_Sleep(100);
+		if (!value)
+			continue;
+		*value++ = '\0';
+		if (strcmp(line, "baud") == 0) {
+			baud = strtof(value, NULL);
+		} else if (strcmp(line, "symbol_width") == 0) {
+			width = atoi(value);
+		} else if (strcmp(line, "frequencies") == 0) {
+			char *end;
 
-	err = Pa_StopStream(stream);
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: stopping stream failed: %s\n",
-			Pa_GetErrorText(err));
-	}
-	err = Pa_CloseStream(stream);
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: closing stream failed: %s\n",
-			Pa_GetErrorText(err));
+			for (n = 0; n < (1 << 8); n++) {
+				freqs[n] = strtof(value, &end);
+				if (end == value)
+					break;
+				value = *end == ',' ? end + 1 : end;
+			}
+		}
 	}
-	err = Pa_Terminate();
-	if (err != paNoError) {
-		fprintf(stderr, "PortAudio: termination failed: %s\n",
-			Pa_GetErrorText(err));
+	fclose(file);
+
+	if (baud <= 0.f || (width != 1 && width != 2 && width != 4 &&
+			    width != 8) || n != 1 << width) {
+		fprintf(stderr, "%s: invalid plan\n", path);
+		return -1;
 	}
-	free(sender_buffer_ptr);
-	free(receiver_buffer_ptr);
-	free(window_buffer);
+	params->baud = baud;
+	params->symbol_width = width;
+	memcpy(params->symbol_freqs, freqs, n * sizeof(float));
+	return 0;
 }
 
 static void dump_packet(const struct sofi_packet *packet, const char *s)
@@ -539,39 +3935,288 @@ static void dump_packet(const struct sofi_packet *packet, const char *s)
 	fprintf(stderr, "}\n");
 }
 
-static uint32_t crc32(unsigned char *buf, size_t len)
+/*
+ * Queue a report for the sender callback to play once the poller is listening
+ * again. There is one poll per RATE_REPORT_INTERVAL packets, so the last report
+ * is long gone by the time the next one is due; if it isn't, the poller times
+ * out as if the report had been lost. Must be called with rate_lock held.
+ */
+static void send_rate_report(const struct modem_params *p,
+			     const struct rate_report *report,
+			     double not_before)
 {
-	uint32_t tab[256];
-	uint32_t val;
+	unsigned char buf[1 + sizeof(*report) + sizeof(uint32_t)];
+	uint32_t crc;
 
-	for (int i = 0; i < 256; i++) {
-		uint32_t crc = i;
-		for (int j = 0; j < 8; j++) {
-			if (crc & 1)
-				crc = (crc >> 1) ^ UINT32_C(0xedb88320);
-			else
-				crc >>= 1;
-		}
-		tab[i] = crc;
+	if (report_queued) {
+		trace(1, "rate report dropped\n");
+		return;
 	}
+	buf[0] = sizeof(*report);
+	memcpy(buf + 1, report, sizeof(*report));
+	crc = crc32(buf, 1 + sizeof(*report));
+	memcpy(buf + 1 + sizeof(*report), &crc, sizeof(crc));
 
-	val = ~UINT32_C(0);
-	for (size_t i = 0; i < len; i++) {
-		int idx = (uint8_t)val ^ (uint8_t)buf[i];
-		val = tab[idx] ^ (val >> 8);
+	trace(2, "rate report: snr = %.2f dB, ok = %d, bad = %d\n",
+	      report->snr / 100.f, report->ok, report->bad);
+	encode_message(p, &report_msg, buf, sizeof(buf), 0, true, false);
+	report_msg.timestamp = monotonic_time();
+	report_params = p;
+	report_not_before = not_before;
+	PaUtil_WriteMemoryBarrier();
+	report_queued = true;
+}
+
+/*
+ * rate_feedback() - account for a received data packet
+ *
+ * Called by the receiver thread as each data packet ends, intact or corrupt, so
+ * the count doesn't depend on the client taking packets off the queue. If the
+ * sender polled for a report, it is queued for the sender callback, which plays
+ * it once the poller's own interpacket gap is over.
+ */
+static void rate_feedback(const struct modem_params *p,
+			  const struct raw_message *msg)
+{
+	unsigned char buf[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+	struct rate_report report;
+	unsigned int corrected;
+	bool ok;
+	int ret;
+
+	if (!p->rate_adaptation || !sender)
+		return;
+
+	ok = decode_message(msg, buf, &corrected) == 0;
+	ret = pthread_mutex_lock(&rate_lock);
+	assert(ret == 0);
+	if (ok) {
+		rx_ok++;
+		rx_snr_sum += isfinite(msg->snr) ? msg->snr : 100.f;
+	} else {
+		rx_bad++;
 	}
-	return ~val;
+	if (msg->poll) {
+		float mean = rx_ok ? rx_snr_sum / rx_ok : 0.f;
+
+		if (mean > INT16_MAX / 100.f)
+			mean = INT16_MAX / 100.f;
+		else if (mean < INT16_MIN / 100.f)
+			mean = INT16_MIN / 100.f;
+		report.snr = (int16_t)(mean * 100.f);
+		report.ok = rx_ok > UINT8_MAX ? UINT8_MAX : rx_ok;
+		report.bad = rx_bad > UINT8_MAX ? UINT8_MAX : rx_bad;
+		rx_ok = rx_bad = 0;
+		rx_snr_sum = 0.f;
+		/* Give the poller a turnaround time after its gap. */
+		send_rate_report(p, &report,
+				 msg->ended + 2. * interpacket_gap(p));
+	}
+	ret = pthread_mutex_unlock(&rate_lock);
+	assert(ret == 0);
+}
+
+/*
+ * The receiver thread shouldn't block on the sender ring, so a corrupt header
+ * is only counted here and reported with the next poll.
+ */
+static void rate_bad_header(void)
+{
+	int ret;
+
+	ret = pthread_mutex_lock(&rate_lock);
+	assert(ret == 0);
+	rx_bad++;
+	ret = pthread_mutex_unlock(&rate_lock);
+	assert(ret == 0);
+}
+
+/* Must be called with rate_lock held. */
+static void rate_step_down(void)
+{
+	tx_clean_reports = 0;
+	if (tx_rung > 0)
+		tx_rung--;
+}
+
+static void handle_control_frame(const struct raw_message *msg)
+{
+	unsigned char buf[sizeof(struct sofi_packet) + sizeof(uint32_t)];
+	struct rate_report report;
+	unsigned int corrected;
+	float snr;
+	int ret;
+
+	if (decode_message(msg, buf, &corrected) || buf[0] != sizeof(report)) {
+		trace(2, "rate report corrupt\n");
+		return;
+	}
+	memcpy(&report, buf + 1, sizeof(report));
+	snr = report.snr / 100.f;
+
+	ret = pthread_mutex_lock(&rate_lock);
+	assert(ret == 0);
+	tx_feedback = true;
+	if (report.bad || snr < rate_ladder[tx_rung].min_snr - RATE_HYSTERESIS) {
+		rate_step_down();
+	} else if (++tx_clean_reports >= RATE_STEP_UP_REPORTS &&
+		   tx_rung < current_params()->max_rung &&
+		   snr >= rate_ladder[tx_rung + 1].min_snr) {
+		tx_clean_reports = 0;
+		tx_rung++;
+	}
+	trace(1, "rate report: snr = %.2f dB, ok = %d, bad = %d; rung = %d\n",
+	      snr, report.ok, report.bad, tx_rung);
+	tx_reports++;
+	ret = pthread_cond_broadcast(&rate_cond);
+	assert(ret == 0);
+	ret = pthread_mutex_unlock(&rate_lock);
+	assert(ret == 0);
+}
+
+/*
+ * next_tx_rung() - pick the rung for the next outgoing packet
+ * @poll: returns whether the packet should poll for a rate report
+ *
+ * Polling only makes sense if we can hear the answer.
+ */
+static int next_tx_rung(const struct modem_params *p, bool *poll)
+{
+	int rung;
+	int ret;
+
+	*poll = false;
+	if (!p->rate_adaptation)
+		return BASE_RUNG;
+
+	ret = pthread_mutex_lock(&rate_lock);
+	assert(ret == 0);
+	rung = tx_rung;
+	if (receiver && ++tx_since_report >= RATE_REPORT_INTERVAL) {
+		tx_since_report = 0;
+		*poll = true;
+	}
+	ret = pthread_mutex_unlock(&rate_lock);
+	assert(ret == 0);
+	return rung;
+}
+
+/* Start waiting for the report to a poll that was just queued. */
+static void rate_expect_report(void)
+{
+	int ret;
+
+	ret = pthread_mutex_lock(&rate_lock);
+	assert(ret == 0);
+	report_wait.pending = true;
+	report_wait.reports = tx_reports;
+	report_wait.timeout = report_wait.quiet = 0.;
+	ret = pthread_mutex_unlock(&rate_lock);
+	assert(ret == 0);
+}
+
+/* Wait for rate_wait_report() with rate_lock held. */
+static int wait_report_locked(double deadline)
+{
+	const struct modem_params *p = current_params();
+	struct timespec ts;
+	double now, until;
+	int ret;
+
+	while (report_wait.pending) {
+		now = monotonic_time();
+		if (report_wait.quiet) {
+			if (now >= report_wait.quiet) {
+				report_wait.pending = false;
+				break;
+			}
+			until = report_wait.quiet;
+		} else if (tx_reports != report_wait.reports) {
+			/* Likewise, the peer isn't listening until its gap is over. */
+			report_wait.quiet = now + 2. * interpacket_gap(p);
+			continue;
+		} else if (report_wait.timeout) {
+			if (now >= report_wait.timeout) {
+				if (tx_feedback)
+					rate_step_down();
+				debug_printf(1, "rate report missing; rung = %d\n", tx_rung);
+				report_wait.quiet = now + 2. * interpacket_gap(p);
+				continue;
+			}
+			until = report_wait.timeout;
+		} else if (!PaUtil_GetRingBufferReadAvailable(&data.sender[0].buffer)) {
+			/* Airtime of a report plus the turnaround and gap on the other end. */
+			report_wait.timeout = now +
+				(symbols_per_byte(p) +
+				 2.f * (1 + sizeof(struct rate_report) + sizeof(uint32_t)) *
+				 CHAR_BIT / rung_width(p, 0)) / p->baud +
+				3.f * interpacket_gap(p) + RATE_REPORT_SLACK;
+			continue;
+		} else {
+			/* The poll is still going out. */
+			until = now + CHAR_BIT / p->baud;
+		}
+		if (deadline <= now)
+			return -1;
+		realtime_deadline(until < deadline ? until : deadline, &ts);
+		ret = pthread_cond_timedwait(&rate_cond, &rate_lock, &ts);
+		assert(ret == 0 || ret == ETIMEDOUT);
+	}
+	return 0;
+}
+
+/*
+ * rate_wait_report() - stay quiet until the peer answers a poll
+ * @deadline: monotonic time to give up at, or INFINITY
+ *
+ * The link is half-duplex, so we have to stop transmitting for the report to
+ * get through. If it doesn't arrive, the peer probably didn't hear the poll.
+ *
+ * Return: 0 once channel 0 is free to send, -1 if the deadline passed first.
+ */
+static int rate_wait_report(double deadline)
+{
+	int ret, err;
+
+	ret = pthread_mutex_lock(&rate_lock);
+	assert(ret == 0);
+	pthread_cleanup_push(unlock_mutex, &rate_lock);
+	err = wait_report_locked(deadline);
+	pthread_cleanup_pop(1);
+	return err;
 }
 
 void sofi_send(const struct sofi_packet *packet)
 {
-	struct raw_message msg;
+	sofi_send_channel(packet, 0);
+}
+
+void sofi_send_channel(const struct sofi_packet *packet, int channel)
+{
+	int ret;
+
+	ret = sofi_timed_send_channel(packet, channel, INFINITY);
+	assert(ret == 0);
+}
+
+int sofi_try_send(const struct sofi_packet *packet)
+{
+	return sofi_timed_send_channel(packet, 0, 0.);
+}
+
+int sofi_timed_send(const struct sofi_packet *packet, double timeout)
+{
+	return sofi_timed_send_channel(packet, 0, timeout);
+}
+
+int sofi_timed_send_channel(const struct sofi_packet *packet, int channel,
+			    double timeout)
+{
+	double deadline = monotonic_time() + timeout;
 	unsigned char buf[sizeof(*packet) + sizeof(uint32_t)];
 	size_t size;
 	uint32_t crc;
-
-	if (debug_level)
-		dump_packet(packet, "send");
+	bool poll;
 
 	size = sizeof(packet->len) + packet->len;
 	memcpy(buf, packet, size);
@@ -579,44 +4224,91 @@ void sofi_send(const struct sofi_packet *packet)
 	memcpy(buf + size, &crc, sizeof(crc));
 	size += sizeof(crc);
 
-	msg.len = 0;
-	for (size_t i = 0; i < size; i++) {
-		unsigned char c = buf[i];
-		for (unsigned int j = 0; j < symbols_per_byte(); j++) {
-			msg.symbols[msg.len++] = c & ((1 << symbol_width) - 1);
-			c >>= symbol_width;
-		}
+	if (channel < 0 || channel >= output_channels) {
+		fprintf(stderr, "sofi_timed_send_channel: no output channel %d\n",
+			channel);
+		errno = EINVAL;
+		return -1;
 	}
-	while (PaUtil_WriteRingBuffer(&data.sender.buffer, &msg, 1) < 1)
-		Pa_Sleep(CHAR_BIT * 1000.f / baud);
+	if (channel == 0 && rate_wait_report(deadline))
+		return -1;
+	if (send_message(channel, buf, size, -1, false, &poll, deadline))
+		return -1;
+	if (debug_level)
+		dump_packet(packet, "send");
+	if (poll)
+		rate_expect_report();
+	return 0;
 }
 
-void sofi_recv(struct sofi_packet *packet)
+int sofi_timed_recv_ex(struct sofi_packet *packet,
+		       struct sofi_packet_info *info, double timeout)
 {
+	double deadline = monotonic_time() + timeout;
 	struct raw_message msg;
 	unsigned char buf[sizeof(*packet) + sizeof(uint32_t)];
-	uint8_t len;
-	uint32_t crc1, crc2;
+	unsigned int corrected;
+	double now;
 
 	for (;;) {
-		recv_queue_dequeue(&msg);
-		memset(buf, 0, sizeof(buf));
-		for (size_t i = 0; i < msg.len; i++) {
-			unsigned char c =
-				msg.symbols[i] << ((i % symbols_per_byte()) * symbol_width);
-			if (i / symbols_per_byte() < sizeof(buf))
-				buf[i / symbols_per_byte()] |= c;
-		}
-		memcpy(&len, buf, sizeof(len));
-		memcpy(&crc1, buf + sizeof(len) + len, sizeof(crc1));
-		crc2 = crc32(buf, sizeof(len) + len);
-		if (crc1 == crc2) {
-			memcpy(packet, buf, sizeof(len) + len);
+		if (recv_queue_dequeue(&msg, deadline))
+			return -1;
+		if (decode_message(&msg, buf, &corrected) == 0) {
+			memcpy(packet, buf, sizeof(packet->len) + buf[0]);
 			if (debug_level)
 				dump_packet(packet, "recv");
-			break;
-		} else {
-			debug_printf(2, "sofi_packet corrupt; 0x%08" PRIx32 " != 0x%08" PRIx32 "\n", crc1, crc2);
+			now = monotonic_time();
+			debug_printf(1, "recv: air %.1f ms, detection %.1f ms, delivery %.1f ms\n",
+				     1000. * (msg.ended - msg.timestamp),
+				     1000. * (msg.demodulated - msg.ended),
+				     1000. * (now - msg.demodulated));
+			stat_add(&stats.packets_received, 1);
+			record_latency(stats.air_to_delivery, now - msg.timestamp);
+			record_stage(SOFI_STAGE_AIR, msg.ended - msg.timestamp);
+			record_stage(SOFI_STAGE_DETECTION,
+				     msg.demodulated - msg.ended);
+			record_stage(SOFI_STAGE_DELIVERY, now - msg.demodulated);
+			info->timestamp = msg.timestamp;
+			info->snr = msg.snr;
+			info->signal_level = msg.signal_level;
+			info->noise_level = msg.noise_level;
+			info->clock_offset = 1e6f * msg.clock_offset;
+			info->frequency_offset = 1e6f * msg.freq_offset;
+			info->corrected = corrected;
+			info->baud = msg.baud;
+			info->symbol_width = msg.width;
+			return 0;
 		}
+		debug_printf(2, "sofi_packet corrupt\n");
+		stat_add(&stats.crc_failures, 1);
 	}
 }
+
+void sofi_recv_ex(struct sofi_packet *packet, struct sofi_packet_info *info)
+{
+	int ret;
+
+	ret = sofi_timed_recv_ex(packet, info, INFINITY);
+	assert(ret == 0);
+}
+
+void sofi_recv(struct sofi_packet *packet)
+{
+	struct sofi_packet_info info;
+
+	sofi_recv_ex(packet, &info);
+}
+
+int sofi_try_recv(struct sofi_packet *packet)
+{
+	struct sofi_packet_info info;
+
+	return sofi_timed_recv_ex(packet, &info, 0.);
+}
+
+int sofi_timed_recv(struct sofi_packet *packet, double timeout)
+{
+	struct sofi_packet_info info;
+
+	return sofi_timed_recv_ex(packet, &info, timeout);
+}
@@ -0,0 +1,169 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+
+#define M_PI 3.14159265359f
+
+/* Upper bound on the interpolation factor, which sets the filter length. */
+#define MAX_UP 1024
+
+static long gcd(long a, long b)
+{
+	while (b) {
+		long t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+int resampler_supported(long in_rate, long out_rate)
+{
+	return out_rate / gcd(in_rate, out_rate) <= MAX_UP;
+}
+
+int resampler_init(struct resampler *r, long in_rate, long out_rate,
+		   float cutoff, int taps)
+{
+	long g = gcd(in_rate, out_rate);
+	int len;
+	float fc, center;
+
+	memset(r, 0, sizeof(*r));
+	r->up = out_rate / g;
+	r->down = in_rate / g;
+	/*
+	 * The filter has to span the given number of samples at the lower of
+	 * the two rates, so decimation needs proportionally longer branches.
+	 */
+	r->taps = taps * ((r->down + r->up - 1) / r->up);
+	taps = r->taps;
+	if (r->up > MAX_UP) {
+		fprintf(stderr, "resampler: %ld Hz to %ld Hz needs too many filter phases\n",
+			in_rate, out_rate);
+		return -1;
+	}
+
+	r->coeffs = malloc((size_t)r->up * taps * sizeof(float));
+	r->history = calloc(2 * (size_t)taps, sizeof(float));
+	r->coeffs_q14 = malloc((size_t)r->up * taps * sizeof(int16_t));
+	r->history_s16 = calloc(2 * (size_t)taps, sizeof(int16_t));
+	if (!r->coeffs || !r->history || !r->coeffs_q14 || !r->history_s16) {
+		perror("malloc");
+		resampler_free(r);
+		return -1;
+	}
+
+	/*
+	 * Blackman-windowed sinc prototype at the upsampled rate, scaled by up
+	 * to make up for the zeros that upsampling stuffs in.
+	 */
+	len = r->up * taps;
+	fc = cutoff / ((float)in_rate * r->up);
+	center = (len - 1) / 2.f;
+	for (int phase = 0; phase < r->up; phase++) {
+		for (int k = 0; k < taps; k++) {
+			int n = phase + (taps - 1 - k) * r->up;
+			float x = n - center;
+			float h, w;
+
+			if (x == 0.f)
+				h = 2.f * fc;
+			else
+				h = sinf(2.f * M_PI * fc * x) / (M_PI * x);
+			w = 0.42f - 0.5f * cosf(2.f * M_PI * n / (len - 1)) +
+			    0.08f * cosf(4.f * M_PI * n / (len - 1));
+			r->coeffs[phase * taps + k] = h * w * r->up;
+			r->coeffs_q14[phase * taps + k] =
+				(int16_t)lrintf(r->coeffs[phase * taps + k] * 16384.f);
+		}
+	}
+	return 0;
+}
+
+void resampler_reset(struct resampler *r)
+{
+	memset(r->history, 0, 2 * (size_t)r->taps * sizeof(float));
+	memset(r->history_s16, 0, 2 * (size_t)r->taps * sizeof(int16_t));
+	r->pos = 0;
+	r->phase = 0;
+}
+
+void resampler_free(struct resampler *r)
+{
+	free(r->coeffs);
+	free(r->history);
+	free(r->coeffs_q14);
+	free(r->history_s16);
+	r->coeffs = r->history = NULL;
+	r->coeffs_q14 = r->history_s16 = NULL;
+}
+
+static inline float dot(const float *restrict a, const float *restrict b, int n)
+{
+	float sum = 0.f;
+
+	for (int i = 0; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+size_t resampler_process(struct resampler *r, const float *in, size_t len,
+			 float *out)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		r->history[r->pos] = r->history[r->pos + r->taps] = in[i];
+		r->pos = (r->pos + 1) % r->taps;
+		while (r->phase < r->up) {
+			out[n++] = dot(&r->coeffs[r->phase * r->taps],
+				       &r->history[r->pos], r->taps);
+			r->phase += r->down;
+		}
+		r->phase -= r->up;
+	}
+	return n;
+}
+
+/*
+ * The accumulator is 64 bits wide because the coefficients of a branch can sum
+ * to more than one; a 32x32+64 multiply-accumulate is a single instruction on
+ * the ARM cores this is meant for.
+ */
+static inline int32_t dot_s16(const int16_t *restrict a,
+			      const int16_t *restrict b, int n)
+{
+	int64_t sum = 0;
+
+	for (int i = 0; i < n; i++)
+		sum += (int32_t)a[i] * b[i];
+	sum >>= 14;
+	if (sum > INT16_MAX)
+		return INT16_MAX;
+	if (sum < INT16_MIN)
+		return INT16_MIN;
+	return (int32_t)sum;
+}
+
+size_t resampler_process_s16(struct resampler *r, const int16_t *in,
+			     size_t len, int16_t *out)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		r->history_s16[r->pos] = r->history_s16[r->pos + r->taps] = in[i];
+		r->pos = (r->pos + 1) % r->taps;
+		while (r->phase < r->up) {
+			out[n++] = dot_s16(&r->coeffs_q14[r->phase * r->taps],
+					   &r->history_s16[r->pos], r->taps);
+			r->phase += r->down;
+		}
+		r->phase -= r->up;
+	}
+	return n;
+}
@@ -0,0 +1,97 @@
+#ifndef SOFI_RESAMPLE_H
+#define SOFI_RESAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Rational polyphase FIR resampler. The input is conceptually upsampled by up,
+ * lowpass filtered, and downsampled by down, but only the filter phases that
+ * land on an output sample are ever computed.
+ */
+struct resampler {
+	/* Interpolation and decimation factors, in lowest terms. */
+	int up, down;
+	/* Number of taps in each polyphase branch. */
+	int taps;
+	/* up branches of taps coefficients each, oldest input first. */
+	float *coeffs;
+	/*
+	 * The last taps inputs, stored twice so that the window ending at the
+	 * newest input is always contiguous.
+	 */
+	float *history;
+	/* The same for 16-bit samples, with coefficients in Q14. */
+	int16_t *coeffs_q14;
+	int16_t *history_s16;
+	int pos;
+	/* Filter phase of the next output relative to the newest input. */
+	int phase;
+};
+
+/**
+ * resampler_init() - set up a resampler between two rates
+ * @in_rate: input sample rate in Hz
+ * @out_rate: output sample rate in Hz
+ * @cutoff: passband edge of the anti-aliasing filter in Hz; must be below
+ *          half of both rates
+ * @taps: length of the filter in samples at the lower of the two rates; more
+ *        taps give a sharper filter
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int resampler_init(struct resampler *r, long in_rate, long out_rate,
+		   float cutoff, int taps);
+
+/**
+ * resampler_supported() - check whether resampler_init() can handle two rates
+ *
+ * Return: nonzero if the rates are supported.
+ */
+int resampler_supported(long in_rate, long out_rate);
+
+/**
+ * resampler_reset() - clear a resampler's history as if it had just been set up
+ */
+void resampler_reset(struct resampler *r);
+
+/**
+ * resampler_free() - free the resources used by a resampler
+ */
+void resampler_free(struct resampler *r);
+
+/**
+ * resampler_max_output() - upper bound on the output of resampler_process()
+ * @len: number of input samples
+ */
+static inline size_t resampler_max_output(const struct resampler *r, size_t len)
+{
+	return (len * r->up) / r->down + 1;
+}
+
+/**
+ * resampler_process() - resample a block of samples
+ * @in: input samples
+ * @len: number of input samples
+ * @out: output buffer of at least resampler_max_output() samples
+ *
+ * Return: the number of output samples.
+ */
+size_t resampler_process(struct resampler *r, const float *in, size_t len,
+			 float *out);
+
+/**
+ * resampler_process_s16() - resample a block of 16-bit samples in fixed point
+ * @in: input samples
+ * @len: number of input samples
+ * @out: output buffer of at least resampler_max_output() samples
+ *
+ * A resampler must only be used with one of resampler_process() and
+ * resampler_process_s16().
+ *
+ * Return: the number of output samples.
+ */
+size_t resampler_process_s16(struct resampler *r, const int16_t *in,
+			     size_t len, int16_t *out);
+
+#endif /* SOFI_RESAMPLE_H */
@@ -0,0 +1,71 @@
+#ifndef SOFI_STAT_H
+#define SOFI_STAT_H
+
+#include <stdbool.h>
+
+/*
+ * Counters that are bumped from several threads without a lock, including the
+ * audio callbacks. Every update is a relaxed atomic read-modify-write and every
+ * read a relaxed atomic load, so no count is lost, but they don't order
+ * anything else.
+ */
+static inline void stat_add(unsigned long *counter, unsigned long n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long stat_read(const unsigned long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void stat_max(unsigned long *counter, unsigned long value)
+{
+	unsigned long old = stat_read(counter);
+
+	while (value > old &&
+	       !__atomic_compare_exchange_n(counter, &old, value, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* There is no atomic floating-point add, so these loop on compare-and-swap. */
+static inline void stat_add_double(double *total, double x)
+{
+	double old, sum;
+
+	__atomic_load(total, &old, __ATOMIC_RELAXED);
+	do {
+		sum = old + x;
+	} while (!__atomic_compare_exchange(total, &old, &sum, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void stat_max_double(double *max, double x)
+{
+	double old;
+
+	__atomic_load(max, &old, __ATOMIC_RELAXED);
+	while (x > old &&
+	       !__atomic_compare_exchange(max, &old, &x, true,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static inline void stat_set_float(float *value, float x)
+{
+	__atomic_store(value, &x, __ATOMIC_RELAXED);
+}
+
+static inline void stat_max_float(float *max, float x)
+{
+	float old;
+
+	__atomic_load(max, &old, __ATOMIC_RELAXED);
+	while (x > old &&
+	       !__atomic_compare_exchange(max, &old, &x, true,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#endif /* SOFI_STAT_H */
@@ -0,0 +1,174 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "stat.h"
+#include "tap.h"
+
+static int open_recording(struct tap *t)
+{
+	t->fd = open(t->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (t->fd == -1) {
+		perror(t->path);
+		return -1;
+	}
+	if (ftruncate(t->fd, t->limit) == -1) {
+		perror("ftruncate");
+		goto err;
+	}
+	t->map = mmap(NULL, t->limit, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      t->fd, 0);
+	if (t->map == MAP_FAILED) {
+		perror("mmap");
+		goto err;
+	}
+	t->pos = 0;
+	return 0;
+
+err:
+	close(t->fd);
+	t->fd = -1;
+	return -1;
+}
+
+/* Cut the recording off after the last chunk. */
+static void close_recording(struct tap *t)
+{
+	if (t->fd == -1)
+		return;
+	munmap(t->map, t->limit);
+	if (ftruncate(t->fd, t->pos) == -1)
+		perror("ftruncate");
+	close(t->fd);
+	t->fd = -1;
+}
+
+int tap_open(struct tap *t, const char *path, size_t limit)
+{
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+	t->limit = limit;
+	t->path = strdup(path);
+	t->old_path = malloc(strlen(path) + sizeof(".old"));
+	if (!t->path || !t->old_path) {
+		perror("malloc");
+		goto err;
+	}
+	strcpy(t->old_path, path);
+	strcat(t->old_path, ".old");
+	for (int i = 0; i < TAP_STREAMS; i++) {
+		t->ring_data[i] = malloc(TAP_RING_SIZE);
+		if (!t->ring_data[i]) {
+			perror("malloc");
+			goto err;
+		}
+		PaUtil_InitializeRingBuffer(&t->rings[i], 1, TAP_RING_SIZE,
+					    t->ring_data[i]);
+	}
+	if (open_recording(t))
+		goto err;
+	return 0;
+
+err:
+	for (int i = 0; i < TAP_STREAMS; i++)
+		free(t->ring_data[i]);
+	free(t->path);
+	free(t->old_path);
+	return -1;
+}
+
+/* Copy into the write regions of a ring as if they were contiguous. */
+static void copy_to_regions(void *data1, size_t size1, void *data2,
+			    size_t offset, const void *src, size_t len)
+{
+	size_t n = 0;
+
+	if (offset < size1) {
+		n = len < size1 - offset ? len : size1 - offset;
+		memcpy((unsigned char *)data1 + offset, src, n);
+	}
+	if (n < len)
+		memcpy((unsigned char *)data2 + (offset + n - size1),
+		       (const unsigned char *)src + n, len - n);
+}
+
+void tap_write(struct tap *t, const struct tap_chunk *chunk,
+	       const void *samples, size_t size)
+{
+	PaUtilRingBuffer *ring = &t->rings[chunk->stream];
+	struct tap_chunk header = *chunk;
+	size_t total = sizeof(header) + size;
+	void *data1, *data2;
+	ring_buffer_size_t size1, size2;
+
+	if ((size_t)PaUtil_GetRingBufferWriteAvailable(ring) < total) {
+		stat_add(&t->dropped, 1);
+		return;
+	}
+	header.magic = TAP_MAGIC;
+
+	/*
+	 * The header and the samples go in as one write, so that the reader
+	 * never sees a header without its samples.
+	 */
+	PaUtil_GetRingBufferWriteRegions(ring, total, &data1, &size1, &data2,
+					 &size2);
+	copy_to_regions(data1, size1, data2, 0, &header, sizeof(header));
+	copy_to_regions(data1, size1, data2, sizeof(header), samples, size);
+	PaUtil_AdvanceRingBufferWriteIndex(ring, total);
+}
+
+static int rotate(struct tap *t)
+{
+	close_recording(t);
+	if (rename(t->path, t->old_path) == -1) {
+		perror("rename");
+		return -1;
+	}
+	return open_recording(t);
+}
+
+int tap_flush(struct tap *t)
+{
+	struct tap_chunk chunk;
+	size_t size;
+
+	if (t->fd == -1)
+		return -1;
+	for (int i = 0; i < TAP_STREAMS; i++) {
+		PaUtilRingBuffer *ring = &t->rings[i];
+
+		while (PaUtil_ReadRingBuffer(ring, &chunk, sizeof(chunk)) ==
+		       sizeof(chunk)) {
+			size = tap_chunk_size(&chunk);
+			if (sizeof(chunk) + size > t->limit) {
+				PaUtil_AdvanceRingBufferReadIndex(ring, size);
+				stat_add(&t->dropped, 1);
+				continue;
+			}
+			if (t->pos + sizeof(chunk) + size > t->limit &&
+			    rotate(t))
+				return -1;
+			memcpy(t->map + t->pos, &chunk, sizeof(chunk));
+			PaUtil_ReadRingBuffer(ring, t->map + t->pos + sizeof(chunk),
+					      size);
+			t->pos += sizeof(chunk) + size;
+		}
+	}
+	return 0;
+}
+
+void tap_close(struct tap *t)
+{
+	tap_flush(t);
+	close_recording(t);
+	for (int i = 0; i < TAP_STREAMS; i++)
+		free(t->ring_data[i]);
+	free(t->path);
+	free(t->old_path);
+}
@@ -0,0 +1,98 @@
+#ifndef SOFI_TAP_H
+#define SOFI_TAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sofi.h"
+#include "pa_ringbuffer.h"
+
+/*
+ * Sample tap. The audio callbacks copy what they capture and play back into a
+ * ring per stream, and a background thread moves it from there into a
+ * memory-mapped recording. A recording is a sequence of chunks, each a struct
+ * tap_chunk followed by its samples, interleaved, in the host's byte order.
+ * When the next chunk doesn't fit under the size limit, the recording is moved
+ * to <path>.old and a new one is started.
+ */
+#define TAP_MAGIC UINT32_C(0x50415453) /* "STAP" */
+#define TAP_RING_SIZE (1UL << 22) /* bytes per stream; must be a power of two. */
+
+enum tap_stream {
+	TAP_CAPTURE,
+	TAP_PLAYBACK,
+	TAP_STREAMS,
+};
+
+struct tap_chunk {
+	uint32_t magic;
+	/* enum tap_stream. */
+	uint16_t stream;
+	uint16_t channels;
+	uint32_t rate;
+	/* enum sofi_sample_format. */
+	uint32_t format;
+	uint32_t frames;
+	uint32_t reserved;
+	/* PortAudio stream time of the first frame in seconds. */
+	double time;
+};
+
+struct tap {
+	PaUtilRingBuffer rings[TAP_STREAMS];
+	void *ring_data[TAP_STREAMS];
+	/* Chunks lost because a ring was full, counted with stat_add(). */
+	unsigned long dropped;
+	char *path, *old_path;
+	size_t limit;
+	int fd;
+	unsigned char *map;
+	size_t pos;
+};
+
+/**
+ * tap_open() - start a recording
+ * @path: file to record to
+ * @limit: size in bytes at which the recording is rotated
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int tap_open(struct tap *t, const char *path, size_t limit);
+
+/**
+ * tap_write() - queue a chunk for the recording
+ * @chunk: header of the chunk, without the magic number
+ * @samples: the chunk's samples
+ * @size: size of the samples in bytes
+ *
+ * This is safe to call from an audio callback, as long as each stream only has
+ * one writer. If the stream's ring is full, the chunk is dropped.
+ */
+void tap_write(struct tap *t, const struct tap_chunk *chunk,
+	       const void *samples, size_t size);
+
+/**
+ * tap_flush() - move the queued chunks into the recording
+ *
+ * This must only be called from one thread at a time.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int tap_flush(struct tap *t);
+
+/**
+ * tap_close() - flush and finish a recording
+ */
+void tap_close(struct tap *t);
+
+/**
+ * tap_chunk_size() - size in bytes of the samples of a chunk
+ */
+static inline size_t tap_chunk_size(const struct tap_chunk *chunk)
+{
+	return (size_t)chunk->frames * chunk->channels *
+	       (chunk->format == SOFI_SAMPLE_INT16 ? sizeof(int16_t) :
+						    sizeof(float));
+}
+
+#endif /* SOFI_TAP_H */
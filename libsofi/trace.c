@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+/* What kind of argument a conversion takes. */
+enum trace_type {
+	TRACE_SIGNED,
+	TRACE_UNSIGNED,
+	TRACE_DOUBLE,
+	TRACE_STRING,
+	TRACE_POINTER,
+	TRACE_UNSUPPORTED,
+};
+
+struct trace_conversion {
+	/* The '%', the length modifier, and just past the conversion. */
+	const char *start, *length, *end;
+	enum trace_type type;
+};
+
+/*
+ * Find the first conversion in s, skipping "%%". Return 0 if there is one and
+ * -1 if there isn't.
+ */
+static int next_conversion(const char *s, struct trace_conversion *c)
+{
+	for (; *s; s++) {
+		if (*s != '%')
+			continue;
+		if (s[1] == '%') {
+			s++;
+			continue;
+		}
+		c->start = s++;
+		s += strspn(s, "-+ #0123456789.*");
+		c->length = s;
+		s += strspn(s, "hljztL");
+		if (memchr(c->start, '*', s - c->start))
+			c->type = TRACE_UNSUPPORTED;
+		else if (*s && strchr("dic", *s))
+			c->type = TRACE_SIGNED;
+		else if (*s && strchr("ouxX", *s))
+			c->type = TRACE_UNSIGNED;
+		else if (*s && strchr("fFeEgGaA", *s) &&
+			 !memchr(c->length, 'L', s - c->length))
+			c->type = TRACE_DOUBLE;
+		else if (*s == 's')
+			c->type = TRACE_STRING;
+		else if (*s == 'p')
+			c->type = TRACE_POINTER;
+		else
+			c->type = TRACE_UNSUPPORTED;
+		c->end = *s ? s + 1 : s;
+		return 0;
+	}
+	return -1;
+}
+
+/* How an argument is taken off the va_list and kept in its slot. */
+enum trace_arg_type {
+	TRACE_ARG_INT,
+	TRACE_ARG_UINT,
+	TRACE_ARG_LONG,
+	TRACE_ARG_ULONG,
+	TRACE_ARG_LLONG,
+	TRACE_ARG_ULLONG,
+	TRACE_ARG_INTMAX,
+	TRACE_ARG_UINTMAX,
+	TRACE_ARG_SIZE,
+	TRACE_ARG_PTRDIFF,
+	TRACE_ARG_DOUBLE,
+	TRACE_ARG_POINTER,
+	TRACE_ARG_NONE,
+};
+
+static bool has_length(const struct trace_conversion *c, const char *length)
+{
+	size_t n = strlen(length);
+
+	return (size_t)(c->end - 1 - c->length) == n &&
+	       strncmp(c->length, length, n) == 0;
+}
+
+static enum trace_arg_type arg_type(const struct trace_conversion *c)
+{
+	bool u = c->type == TRACE_UNSIGNED;
+
+	switch (c->type) {
+	case TRACE_SIGNED:
+	case TRACE_UNSIGNED:
+		if (has_length(c, "l"))
+			return u ? TRACE_ARG_ULONG : TRACE_ARG_LONG;
+		if (has_length(c, "ll"))
+			return u ? TRACE_ARG_ULLONG : TRACE_ARG_LLONG;
+		if (has_length(c, "j"))
+			return u ? TRACE_ARG_UINTMAX : TRACE_ARG_INTMAX;
+		if (has_length(c, "z"))
+			return TRACE_ARG_SIZE;
+		if (has_length(c, "t"))
+			return TRACE_ARG_PTRDIFF;
+		return u ? TRACE_ARG_UINT : TRACE_ARG_INT;
+	case TRACE_DOUBLE:
+		return TRACE_ARG_DOUBLE;
+	case TRACE_STRING:
+	case TRACE_POINTER:
+		return TRACE_ARG_POINTER;
+	case TRACE_UNSUPPORTED:
+		break;
+	}
+	return TRACE_ARG_NONE;
+}
+
+/*
+ * Work out the argument types of a call site's format. Arguments after an
+ * unsupported conversion can't be found, so they are left out.
+ */
+static void classify(struct trace_site *site, const char *format)
+{
+	struct trace_conversion c;
+	enum trace_arg_type type;
+	const char *s = format;
+
+	site->args = 0;
+	while (site->args < TRACE_ARGS && next_conversion(s, &c) == 0) {
+		type = arg_type(&c);
+		if (type == TRACE_ARG_NONE)
+			break;
+		site->types[site->args++] = type;
+		s = c.end;
+	}
+	site->classified = true;
+}
+
+/*
+ * Take an argument of the given type off ap. Signed and unsigned arguments
+ * share a slot, and size_t and ptrdiff_t pass through it either way.
+ */
+static union trace_arg read_arg(enum trace_arg_type type, va_list *ap)
+{
+	union trace_arg arg = {0};
+
+	switch (type) {
+	case TRACE_ARG_INT:
+		arg.i = va_arg(*ap, int);
+		break;
+	case TRACE_ARG_UINT:
+		arg.u = va_arg(*ap, unsigned int);
+		break;
+	case TRACE_ARG_LONG:
+		arg.i = va_arg(*ap, long);
+		break;
+	case TRACE_ARG_ULONG:
+		arg.u = va_arg(*ap, unsigned long);
+		break;
+	case TRACE_ARG_LLONG:
+		arg.i = va_arg(*ap, long long);
+		break;
+	case TRACE_ARG_ULLONG:
+		arg.u = va_arg(*ap, unsigned long long);
+		break;
+	case TRACE_ARG_INTMAX:
+		arg.i = va_arg(*ap, intmax_t);
+		break;
+	case TRACE_ARG_UINTMAX:
+		arg.u = va_arg(*ap, uintmax_t);
+		break;
+	case TRACE_ARG_SIZE:
+		arg.u = va_arg(*ap, size_t);
+		break;
+	case TRACE_ARG_PTRDIFF:
+		arg.i = va_arg(*ap, ptrdiff_t);
+		break;
+	case TRACE_ARG_DOUBLE:
+		arg.d = va_arg(*ap, double);
+		break;
+	case TRACE_ARG_POINTER:
+		arg.p = va_arg(*ap, const void *);
+		break;
+	case TRACE_ARG_NONE:
+		break;
+	}
+	return arg;
+}
+
+/* Print the text of a format from s to end, which holds no conversions. */
+static void print_text(FILE *f, const char *s, const char *end)
+{
+	for (; s < end; s++) {
+		fputc(*s, f);
+		if (s[0] == '%' && s[1] == '%')
+			s++;
+	}
+}
+
+/*
+ * Print an argument as the conversion says. Integers were widened when they
+ * were recorded, so the conversion is printed with a 'j' length instead of its
+ * own.
+ */
+static void print_arg(FILE *f, const struct trace_conversion *c,
+		      union trace_arg arg)
+{
+	char spec[32];
+	size_t n = c->length - c->start;
+
+	if (c->type == TRACE_UNSUPPORTED || n + 3 > sizeof(spec)) {
+		print_text(f, c->start, c->end);
+		return;
+	}
+	memcpy(spec, c->start, n);
+	if ((c->type == TRACE_SIGNED || c->type == TRACE_UNSIGNED) &&
+	    c->end[-1] != 'c')
+		spec[n++] = 'j';
+	spec[n++] = c->end[-1];
+	spec[n] = '\0';
+
+	switch (c->type) {
+	case TRACE_SIGNED:
+		if (c->end[-1] == 'c')
+			fprintf(f, spec, (int)arg.i);
+		else
+			fprintf(f, spec, arg.i);
+		break;
+	case TRACE_UNSIGNED:
+		fprintf(f, spec, arg.u);
+		break;
+	case TRACE_DOUBLE:
+		fprintf(f, spec, arg.d);
+		break;
+	case TRACE_STRING:
+		fprintf(f, spec, (const char *)arg.p);
+		break;
+	case TRACE_POINTER:
+		fprintf(f, spec, arg.p);
+		break;
+	case TRACE_UNSUPPORTED:
+		break;
+	}
+}
+
+int trace_ring_init(struct trace_ring *ring)
+{
+	ring->dropped = ring->reported = 0;
+	ring->records = malloc(TRACE_RING_SIZE * sizeof(struct trace_record));
+	if (!ring->records) {
+		perror("malloc");
+		return -1;
+	}
+	if (PaUtil_InitializeRingBuffer(&ring->buffer,
+					sizeof(struct trace_record),
+					TRACE_RING_SIZE, ring->records) < 0) {
+		trace_ring_free(ring);
+		return -1;
+	}
+	return 0;
+}
+
+void trace_ring_free(struct trace_ring *ring)
+{
+	free(ring->records);
+	ring->records = NULL;
+}
+
+void trace_record(struct trace_ring *ring, struct trace_site *site,
+		  const char *format, ...)
+{
+	struct trace_record r;
+	struct timespec ts;
+	va_list ap;
+	int ret;
+
+	if (!site->classified)
+		classify(site, format);
+	ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+	assert(ret == 0);
+	r.time = ts.tv_sec + ts.tv_nsec / 1e9;
+	r.format = format;
+	va_start(ap, format);
+	for (int i = 0; i < site->args; i++)
+		r.args[i] = read_arg(site->types[i], &ap);
+	va_end(ap);
+	if (PaUtil_WriteRingBuffer(&ring->buffer, &r, 1) < 1)
+		ring->dropped++;
+}
+
+void trace_drain(struct trace_ring *ring, FILE *f)
+{
+	struct trace_record r;
+	struct trace_conversion c;
+	unsigned long dropped;
+	const char *s;
+
+	while (PaUtil_ReadRingBuffer(&ring->buffer, &r, 1) == 1) {
+		fprintf(f, "[%.6f] ", r.time);
+		s = r.format;
+		for (int i = 0; i < TRACE_ARGS && next_conversion(s, &c) == 0 &&
+		     c.type != TRACE_UNSUPPORTED; i++) {
+			print_text(f, s, c.start);
+			print_arg(f, &c, r.args[i]);
+			s = c.end;
+		}
+		print_text(f, s, s + strlen(s));
+	}
+	dropped = ring->dropped;
+	if (dropped != ring->reported) {
+		fprintf(f, "(%lu trace records dropped)\n",
+			dropped - ring->reported);
+		ring->reported = dropped;
+	}
+}
@@ -0,0 +1,86 @@
+#ifndef SOFI_TRACE_H
+#define SOFI_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pa_ringbuffer.h"
+
+/*
+ * Binary trace. A thread that can't afford to format messages writes fixed-size
+ * records into its own ring instead, and another thread formats them later. A
+ * record is a format string, which must be a literal, and up to TRACE_ARGS
+ * arguments. The format says what type each argument is, as it does for
+ * printf(), and the argument is kept in a slot of that kind: integers of any
+ * length, doubles, and strings, which must be literals too. Long doubles and
+ * conversions that take their width or precision from an argument aren't
+ * supported. Each call site works out its format's argument types the first
+ * time it is traced and keeps them in a struct trace_site, so that writing a
+ * record doesn't have to scan the format.
+ */
+#define TRACE_ARGS 4
+#define TRACE_RING_SIZE 4096 /* records; must be a power of two. */
+
+union trace_arg {
+	intmax_t i;
+	uintmax_t u;
+	double d;
+	const void *p;
+};
+
+struct trace_site {
+	bool classified;
+	int args;
+	unsigned char types[TRACE_ARGS];
+};
+
+struct trace_record {
+	/* Monotonic time in seconds that the record was written. */
+	double time;
+	const char *format;
+	union trace_arg args[TRACE_ARGS];
+};
+
+/* A single-producer, single-consumer ring of trace records. */
+struct trace_ring {
+	PaUtilRingBuffer buffer;
+	struct trace_record *records;
+	/* Records lost because the ring was full, and how many were reported. */
+	volatile unsigned long dropped;
+	unsigned long reported;
+};
+
+/**
+ * trace_ring_init() - allocate an empty trace ring
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int trace_ring_init(struct trace_ring *ring);
+
+/**
+ * trace_ring_free() - free a trace ring's records
+ */
+void trace_ring_free(struct trace_ring *ring);
+
+/**
+ * trace_record() - write a record to a trace ring
+ * @site: the call site's argument types, zeroed before its first record
+ * @format: printf() format of the record, followed by its arguments
+ *
+ * This never blocks; if the ring is full, the record is dropped and counted.
+ * Arguments past the first TRACE_ARGS are ignored. A call site's records must
+ * all be written from the same thread.
+ */
+void trace_record(struct trace_ring *ring, struct trace_site *site,
+		  const char *format, ...);
+
+/**
+ * trace_drain() - format the records in a trace ring
+ * @f: stream to print the records to
+ *
+ * This must only be called from one thread at a time for a ring.
+ */
+void trace_drain(struct trace_ring *ring, FILE *f);
+
+#endif /* SOFI_TRACE_H */
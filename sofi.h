@@ -9,9 +9,45 @@ struct sofi_packet {
 	char payload[UINT8_MAX];
 };
 
+enum sofi_sample_format {
+	/* 32-bit floating point samples. */
+	SOFI_SAMPLE_FLOAT32,
+	/* 16-bit integer samples, processed in fixed point. */
+	SOFI_SAMPLE_INT16,
+};
+
+enum sofi_combining {
+	/* Average the channels weighted by their signal-to-noise ratio. */
+	SOFI_COMBINE_MRC,
+	/* Use the channel with the clearest symbol in each window. */
+	SOFI_COMBINE_SELECTION,
+};
+
 struct sofi_init_parameters {
-	/* The capture/output sample rate. */
+	/*
+	 * The capture/output sample rate. If the devices don't support it,
+	 * they are opened at their native rate instead. The receiver
+	 * demodulates at a lower rate picked from the frequencies.
+	 */
 	float sample_rate;
+	/* Always open the devices at their native rate. */
+	bool native_rate;
+	/*
+	 * Sample format of the streams and the receiver's buffers. This can't
+	 * be changed by sofi_reconfigure().
+	 */
+	enum sofi_sample_format sample_format;
+	/*
+	 * Number of input channels to capture (at most 8). The tone strengths
+	 * of the channels are combined before each symbol decision.
+	 */
+	int input_channels;
+	enum sofi_combining combining;
+	/*
+	 * Number of output channels (at most 8). Each one carries its own
+	 * stream of packets; see sofi_send_channel().
+	 */
+	int output_channels;
 	/* Number of symbols per second. */
 	float baud;
 	/* Factor of symbol length to use for detecting a carrier wave. */
@@ -24,12 +60,54 @@ struct sofi_init_parameters {
 	float symbol_freqs[1 << 8];
 	/* Run the sender/receiver. */
 	bool sender, receiver;
+	/*
+	 * Adapt the baud, symbol width, and FEC to the channel. This changes
+	 * the framing, so it must be enabled on both ends, and it only adapts
+	 * when both ends run the sender and the receiver so that the receiver
+	 * can report back.
+	 */
+	bool rate_adaptation;
 	/* Level of debugging messages to print. */
 	int debug_level;
+	/*
+	 * PortAudio host API and device names to use, or NULL for the
+	 * defaults. Devices are only looked up within the one host API. The
+	 * input and output are opened as separate streams, so they can be
+	 * different cards running at different rates.
+	 */
+	const char *host_api;
+	const char *input_device, *output_device;
+	/*
+	 * File to remember the selected devices and latencies in, or NULL. The
+	 * cached selection is used for any of the above that are NULL.
+	 */
+	const char *device_cache;
+	/*
+	 * Frames per audio callback, or 0 to let PortAudio pick (which varies
+	 * wildly between hosts). See sofi_calibrate().
+	 */
+	unsigned long frames_per_buffer;
+	/*
+	 * Suggested input/output latency in seconds, or 0 for the device's
+	 * default low latency.
+	 */
+	double input_latency, output_latency;
+	/*
+	 * File to record the captured and played back samples to, or NULL. A
+	 * recording that reaches record_limit bytes is moved to <path>.old
+	 * and a new one is started.
+	 */
+	const char *record_path;
+	unsigned long record_limit;
 };
 
 #define DEFAULT_SOFI_INIT_PARAMS {	\
 	.sample_rate = 192000.f,	\
+	.native_rate = false,		\
+	.sample_format = SOFI_SAMPLE_FLOAT32, \
+	.input_channels = 1,		\
+	.combining = SOFI_COMBINE_MRC,	\
+	.output_channels = 1,		\
 	.baud = 1200.f,			\
 	.recv_window_factor = 0.1f,	\
 	.interpacket_gap_factor = 15.f,	\
@@ -37,7 +115,17 @@ struct sofi_init_parameters {
 	.symbol_freqs = {2400.f, 1200.f, 4800.f, 3600.f}, \
 	.sender = true,			\
 	.receiver = true,		\
+	.rate_adaptation = false,	\
 	.debug_level = 0,		\
+	.host_api = NULL,		\
+	.input_device = NULL,		\
+	.output_device = NULL,		\
+	.device_cache = NULL,		\
+	.frames_per_buffer = 0,		\
+	.input_latency = 0.,		\
+	.output_latency = 0.,		\
+	.record_path = NULL,		\
+	.record_limit = 64UL << 20,	\
 }
 
 /**
@@ -48,6 +136,21 @@ struct sofi_init_parameters {
  */
 int sofi_init(const struct sofi_init_parameters *params);
 
+/**
+ * sofi_calibrate() - find the smallest stable buffer size on this host
+ * @params: instance parameters
+ * @frames_per_buffer: returns the buffer size in frames
+ *
+ * This runs the configured devices for a few seconds at each power-of-two
+ * buffer size and picks the smallest one without over- or underflows. If
+ * @params has a device cache, the result is stored there for sofi_init() to
+ * use. It must not be called while the library is initialized.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int sofi_calibrate(const struct sofi_init_parameters *params,
+		   unsigned long *frames_per_buffer);
+
 /**
  * sofi_destroy() - free the resources used by the So-Fi library
  *
@@ -55,6 +158,260 @@ int sofi_init(const struct sofi_init_parameters *params);
  */
 void sofi_destroy(void);
 
+/**
+ * sofi_reconfigure() - change the modulation parameters of a running instance
+ * @params: new instance parameters
+ *
+ * The baud, frequencies, symbol width, gap, window, rate adaptation, and debug
+ * level take effect between packets without restarting the audio stream. The
+ * sample rate must stay the same, and sender, receiver, the sample format, and
+ * the channels are ignored. This blocks until queued packets have been
+ * transmitted with the old parameters.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int sofi_reconfigure(const struct sofi_init_parameters *params);
+
+/**
+ * struct sofi_sounding - per-tone SNR measured by a channel sounding
+ * @baud: baud that the probe was sent at, which is also its tone spacing
+ * @freqs: frequency in Hz of each of the probe's tones
+ * @snr: SNR in dB of each tone at the probe's baud
+ * @level: amplitude of each tone as received, as a fraction of full scale
+ */
+struct sofi_sounding {
+	float baud;
+	float freqs[1 << 8];
+	float snr[1 << 8];
+	float level[1 << 8];
+};
+
+/**
+ * sofi_send_probe() - send a channel sounding probe
+ * @min_freq: lowest frequency to probe in Hz
+ * @max_freq: highest frequency to probe in Hz
+ *
+ * The probe steps through 256 tones evenly spaced from min_freq up to max_freq,
+ * a whole number of Hz apart, at a baud of one tone spacing, so it takes about
+ * 768 / baud seconds. The band has to be at least 255 Hz wide. The peer has
+ * to be waiting in sofi_recv_probe() with the same band. The instance is put
+ * back to its previous parameters once the probe has been sent.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int sofi_send_probe(float min_freq, float max_freq);
+
+/**
+ * sofi_recv_probe() - measure a channel sounding probe from the peer
+ * @min_freq: lowest frequency to probe in Hz
+ * @max_freq: highest frequency to probe in Hz
+ * @timeout: longest time to wait for the whole probe in seconds, or INFINITY
+ * @result: returned per-tone SNR
+ *
+ * This blocks until a probe sent with sofi_send_probe() has been received or
+ * the timeout runs out. Either way, the instance is put back to its previous
+ * parameters.
+ *
+ * Return: 0 on success, -1 on error or if the timeout ran out first.
+ */
+int sofi_recv_probe(float min_freq, float max_freq, double timeout,
+		    struct sofi_sounding *result);
+
+/**
+ * sofi_select_plan() - pick the fastest frequency plan that a channel supports
+ * @sounding: result of sofi_recv_probe()
+ * @min_snr: SNR in dB that every tone has to reach at the chosen baud
+ * @params: instance parameters whose baud, symbol width, and frequencies are
+ *          replaced
+ *
+ * Tones that arrive too quiet for the receiver to pick up reliably are left
+ * out, however clean they are. The listen window also has to hold at least
+ * 16 samples at the sample rate in @params, which the receiver needs to pick
+ * up a carrier, and that puts a ceiling on the baud for the window factor.
+ *
+ * Return: 0 on success, -1 if no plan reaches min_snr.
+ */
+int sofi_select_plan(const struct sofi_sounding *sounding, float min_snr,
+		     struct sofi_init_parameters *params);
+
+/**
+ * sofi_write_plan() - store the frequency plan of a set of parameters
+ * @path: file to store the baud, symbol width, and frequencies in
+ * @params: instance parameters
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int sofi_write_plan(const char *path, const struct sofi_init_parameters *params);
+
+/**
+ * sofi_read_plan() - load a frequency plan stored by sofi_write_plan()
+ * @path: file that the plan is stored in
+ * @params: instance parameters whose baud, symbol width, and frequencies are
+ *          replaced
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int sofi_read_plan(const char *path, struct sofi_init_parameters *params);
+
+/**
+ * struct sofi_capture_stats - state of the receiver's capture front-end
+ * @gain: gain that the automatic gain control is applying to the capture
+ * @clipped: samples captured at full scale since sofi_init()
+ * @overflows: audio callbacks since sofi_init() that lost input, either in the
+ *             device or because the receiver fell behind
+ */
+struct sofi_capture_stats {
+	float gain;
+	unsigned long clipped;
+	unsigned long overflows;
+};
+
+/**
+ * sofi_get_capture_stats() - read the state of the receiver's capture front-end
+ * @stats: returned state
+ */
+void sofi_get_capture_stats(struct sofi_capture_stats *stats);
+
+#define SOFI_LATENCY_BUCKETS 16
+#define SOFI_LOAD_BUCKETS 11
+
+/**
+ * struct sofi_callback_stats - timing of one stream's audio callbacks
+ * @calls: callbacks run
+ * @underflows: callbacks that PortAudio flagged with an underflow
+ * @overflows: callbacks that PortAudio flagged with an overflow
+ * @load: histogram of each callback's run time as a fraction of its buffer
+ *        period; bucket i counts those from i / 10 up to (i + 1) / 10, and the
+ *        last bucket counts callbacks that overran their period
+ * @max_load: longest callback run time as a fraction of its buffer period
+ *
+ * A callback that comes close to its period leaves the audio device no slack;
+ * those, and the flagged under- and overflows, are a sign that the buffers are
+ * too small for the host.
+ */
+struct sofi_callback_stats {
+	unsigned long calls;
+	unsigned long underflows;
+	unsigned long overflows;
+	unsigned long load[SOFI_LOAD_BUCKETS];
+	float max_load;
+};
+
+/**
+ * enum sofi_stage - legs of a packet's trip from sofi_send() to sofi_recv()
+ * @SOFI_STAGE_QUEUE: from sofi_send() until the sender starts modulating it,
+ *                    apart from any wait for the previous packet's gap
+ * @SOFI_STAGE_GAP: waiting out the interpacket gap of the packet before it
+ * @SOFI_STAGE_OUTPUT: from being modulated to its first sample reaching the
+ *                     DAC, which is the latency of the output device
+ * @SOFI_STAGE_AIR: from its first sample leaving the ADC to its last, as the
+ *                  receiver heard them
+ * @SOFI_STAGE_DETECTION: from its last sample leaving the ADC to being
+ *                        demodulated, which takes in the input device's
+ *                        latency, the backlog in the capture ring, and the
+ *                        window that hears the carrier stop
+ * @SOFI_STAGE_DELIVERY: from being demodulated to sofi_recv() returning it
+ *
+ * The sender times the first three and the receiver the rest, so a link's
+ * end-to-end latency is the sum over both ends, plus the time that the sound
+ * takes to travel between them.
+ */
+enum sofi_stage {
+	SOFI_STAGE_QUEUE,
+	SOFI_STAGE_GAP,
+	SOFI_STAGE_OUTPUT,
+	SOFI_STAGE_AIR,
+	SOFI_STAGE_DETECTION,
+	SOFI_STAGE_DELIVERY,
+	SOFI_STAGES,
+};
+
+/**
+ * struct sofi_stage_stats - time that packets spent in one stage
+ * @packets: packets timed
+ * @total: their total time in the stage in seconds
+ * @max: longest time a packet spent in the stage in seconds
+ * @histogram: histogram of the time each packet spent in the stage
+ */
+struct sofi_stage_stats {
+	unsigned long packets;
+	double total;
+	double max;
+	unsigned long histogram[SOFI_LATENCY_BUCKETS];
+};
+
+/**
+ * struct sofi_stats - counters of a running instance since sofi_init()
+ * @packets_sent: client packets that have been transmitted
+ * @packets_received: client packets returned by sofi_recv()
+ * @crc_failures: received packets dropped because their CRC didn't match
+ * @recv_queue_overflows: received packets dropped because sofi_recv() wasn't
+ *                        called often enough to keep up
+ * @capture_high_water: most frames that have been waiting in the capture ring
+ *                      buffer at once
+ * @capture_ring_size: size of the capture ring buffer in frames
+ * @clock_offset: the receiver's estimate of how much longer the sender's
+ *                symbols are than nominal, in ppm, as of the last packet it
+ *                heard; it is averaged over the recent packets
+ * @frequency_offset: the receiver's estimate of how much higher the tones are
+ *                    heard than nominal, in ppm, likewise
+ * @input: the input stream's audio callbacks
+ * @output: the output stream's audio callbacks
+ * @enqueue_to_air: histogram of the time from sofi_send() queueing a packet
+ *                  to its first symbol being modulated
+ * @air_to_delivery: histogram of the time from a packet's first sample leaving
+ *                   the ADC to sofi_recv() returning it, which takes in the
+ *                   input device's latency
+ * @stages: time spent in each stage, indexed by enum sofi_stage; only client
+ *          packets are timed, and only the ones delivered intact on the
+ *          receiver
+ * @capture: the same as sofi_get_capture_stats()
+ *
+ * Bucket 0 of a histogram counts latencies under a millisecond, bucket i counts
+ * those from 2^(i - 1) up to 2^i ms, and the last bucket also counts anything
+ * longer. The counters are read without stopping the instance, so they can be
+ * slightly out of step with each other.
+ */
+struct sofi_stats {
+	unsigned long packets_sent;
+	unsigned long packets_received;
+	unsigned long crc_failures;
+	unsigned long recv_queue_overflows;
+	unsigned long capture_high_water;
+	unsigned long capture_ring_size;
+	float clock_offset;
+	float frequency_offset;
+	struct sofi_callback_stats input;
+	struct sofi_callback_stats output;
+	unsigned long enqueue_to_air[SOFI_LATENCY_BUCKETS];
+	unsigned long air_to_delivery[SOFI_LATENCY_BUCKETS];
+	struct sofi_stage_stats stages[SOFI_STAGES];
+	struct sofi_capture_stats capture;
+};
+
+/**
+ * sofi_get_stats() - read the counters of the running instance
+ * @stats: returned counters
+ *
+ * The counters keep their values after sofi_destroy(), which transmits any
+ * outstanding packets first, until the next sofi_init().
+ */
+void sofi_get_stats(struct sofi_stats *stats);
+
+/**
+ * sofi_replay() - feed a recording to the receiver in place of the input
+ * @path: file recorded with the record_path parameter
+ *
+ * The captured samples are handed to the receiver exactly as they were
+ * recorded, as fast as it takes them, and the input device is ignored until
+ * the recording runs out. The instance must be receiving with the same input
+ * rate, channels, and sample format as the recording; the played back samples
+ * are skipped.
+ *
+ * Return: 0 on success, -1 on error.
+ */
+int sofi_replay(const char *path);
+
 /**
  * sofi_send() - send a packet over So-Fi
  *
@@ -63,6 +420,48 @@ void sofi_destroy(void);
  */
 void sofi_send(const struct sofi_packet *packet);
 
+/**
+ * sofi_send_channel() - send a packet on one output channel
+ * @channel: the output channel, which must be less than output_channels
+ *
+ * Each channel has its own queue and modulator, so packets on different
+ * channels are transmitted in parallel. sofi_send() sends on channel 0, which
+ * is the only one that adapts its rate. Like sofi_send(), this blocks until the
+ * packet is queued.
+ */
+void sofi_send_channel(const struct sofi_packet *packet, int channel);
+
+/**
+ * sofi_try_send() - queue a packet only if there is room right away
+ *
+ * Return: 0 if the packet was queued, -1 if it would have had to wait.
+ */
+int sofi_try_send(const struct sofi_packet *packet);
+
+/**
+ * sofi_timed_send() - queue a packet, waiting for room for a limited time
+ * @timeout: longest time to wait in seconds, or INFINITY
+ *
+ * Return: 0 if the packet was queued, -1 if the timeout ran out first.
+ */
+int sofi_timed_send(const struct sofi_packet *packet, double timeout);
+
+/**
+ * sofi_timed_send_channel() - queue a packet on one output channel, waiting
+ *                             for room for a limited time
+ * @channel: the output channel, which must be less than output_channels
+ * @timeout: longest time to wait in seconds, 0 to not wait, or INFINITY
+ *
+ * With rate adaptation, a packet that polls the receiver for a rate report is
+ * followed by a quiet spell on channel 0 while the report comes back. The next
+ * packet on the channel waits it out, and counts it against its timeout.
+ *
+ * Return: 0 if the packet was queued, -1 if the timeout ran out first or the
+ * channel doesn't exist, in which case errno is set to EINVAL.
+ */
+int sofi_timed_send_channel(const struct sofi_packet *packet, int channel,
+			    double timeout);
+
 /**
  * sofi_recv() - receive a packet over So-Fi
  *
@@ -70,4 +469,68 @@ void sofi_send(const struct sofi_packet *packet);
  */
 void sofi_recv(struct sofi_packet *packet);
 
+/**
+ * struct sofi_packet_info - what the receiver measured of a packet
+ * @timestamp: CLOCK_MONOTONIC time in seconds at which the packet's first
+ *             sample left the ADC
+ * @snr: strength of the decided tones over that of the others in dB
+ * @signal_level: mean power of the decided tones in dB relative to a
+ *                full-scale tone at the input, before the capture gain
+ * @noise_level: mean power of each of the other tones, in the same terms
+ * @clock_offset: how much longer the sender's symbols are than nominal by the
+ *                receiver's clock, in ppm
+ * @frequency_offset: how much higher the tones are heard than nominal, in ppm
+ * @corrected: bit errors corrected by forward error correction
+ * @baud: symbol rate that the body of the packet was sent at
+ * @symbol_width: number of bits per symbol in the body of the packet
+ *
+ * The clock and frequency offsets are the receiver's long-term estimates for
+ * the link, updated with this packet.
+ */
+struct sofi_packet_info {
+	double timestamp;
+	float snr;
+	float signal_level;
+	float noise_level;
+	float clock_offset;
+	float frequency_offset;
+	unsigned int corrected;
+	float baud;
+	int symbol_width;
+};
+
+/**
+ * sofi_recv_ex() - receive a packet along with what was measured of it
+ * @info: returned measurements
+ *
+ * This is the same as sofi_recv() otherwise.
+ */
+void sofi_recv_ex(struct sofi_packet *packet, struct sofi_packet_info *info);
+
+/**
+ * sofi_try_recv() - receive a packet if one is already waiting
+ *
+ * Return: 0 if a packet was received, -1 if there was none.
+ */
+int sofi_try_recv(struct sofi_packet *packet);
+
+/**
+ * sofi_timed_recv() - receive a packet, waiting for one for a limited time
+ * @timeout: longest time to wait in seconds, or INFINITY
+ *
+ * Return: 0 if a packet was received, -1 if the timeout ran out first.
+ */
+int sofi_timed_recv(struct sofi_packet *packet, double timeout);
+
+/**
+ * sofi_timed_recv_ex() - receive a packet along with what was measured of it,
+ *                        waiting for one for a limited time
+ * @info: returned measurements
+ * @timeout: longest time to wait in seconds, 0 to not wait, or INFINITY
+ *
+ * Return: 0 if a packet was received, -1 if the timeout ran out first.
+ */
+int sofi_timed_recv_ex(struct sofi_packet *packet,
+		       struct sofi_packet_info *info, double timeout);
+
 #endif /* SOFI_H */
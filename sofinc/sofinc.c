@@ -1,21 +1,51 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "sofi.h"
 
 #define MAX_MESSAGE_LENGTH (sizeof(((struct sofi_packet *)0)->payload))
 
+/* SNR in dB that every tone of a plan picked by sounding has to reach. */
+#define SOUNDING_MIN_SNR 10.f
+
 static const char *progname = "sofinc";
 static bool keep_open;
+static int debug_level;
 static size_t max_message_length = MAX_MESSAGE_LENGTH;
+static int send_channel;
 
 static pthread_t sender_thread, receiver_thread;
 
+/* Long options without a short equivalent. */
+enum {
+	OPT_HOST_API = 256,
+	OPT_INPUT_DEVICE,
+	OPT_OUTPUT_DEVICE,
+	OPT_DEVICE_CACHE,
+	OPT_FRAMES_PER_BUFFER,
+	OPT_LATENCY,
+	OPT_CALIBRATE,
+	OPT_NATIVE_RATE,
+	OPT_SAMPLE_FORMAT,
+	OPT_INPUT_CHANNELS,
+	OPT_COMBINING,
+	OPT_OUTPUT_CHANNELS,
+	OPT_CHANNEL,
+	OPT_SOUND,
+	OPT_SOUND_TIMEOUT,
+	OPT_PLAN,
+	OPT_RECORD,
+	OPT_RECORD_LIMIT,
+	OPT_REPLAY,
+};
+
 static void *sender_loop(void *receiver)
 {
 	struct sofi_packet packet;
@@ -27,10 +57,10 @@ static void *sender_loop(void *receiver)
 				   stdin);
 		if (packet.len == 0)
 			break;
-		sofi_send(&packet);
+		sofi_send_channel(&packet, send_channel);
 	}
 	packet.len = 0;
-	sofi_send(&packet);
+	sofi_send_channel(&packet, send_channel);
 	if (ferror(stdin) && errno != EINTR) {
 		perror("fread");
 		status = (void *)-1;
@@ -45,11 +75,19 @@ static void *sender_loop(void *receiver)
 static void *receiver_loop(void *sender)
 {
 	struct sofi_packet packet;
+	struct sofi_packet_info info;
 	void *status = (void *)0;
 	int ret;
 
 	for (;;) {
-		sofi_recv(&packet);
+		sofi_recv_ex(&packet, &info);
+		if (debug_level) {
+			fprintf(stderr, "Received %u bytes: SNR %.1f dB, signal %.1f dB, noise %.1f dB, clock %+.0f ppm, frequency %+.0f ppm, %u corrected, %.0f baud, %d bits/symbol\n",
+				packet.len, info.snr, info.signal_level,
+				info.noise_level, info.clock_offset,
+				info.frequency_offset, info.corrected, info.baud,
+				info.symbol_width);
+		}
 		if (packet.len == 0 && !keep_open) {
 			if (fclose(stdout))
 				perror("fclose");
@@ -70,6 +108,126 @@ static void *receiver_loop(void *sender)
 	return status;
 }
 
+/*
+ * Sound the channel: the sender sends a probe, and the receiver measures it,
+ * prints the SNR of each tone, and picks a plan.
+ */
+static int sound(const struct sofi_init_parameters *params, float min_freq,
+		 float max_freq, double timeout, const char *plan)
+{
+	struct sofi_init_parameters plan_params = *params;
+	struct sofi_sounding sounding;
+
+	if (params->sender)
+		return sofi_send_probe(min_freq, max_freq);
+
+	if (sofi_recv_probe(min_freq, max_freq, timeout, &sounding))
+		return -1;
+	for (int i = 0; i < 256; i++)
+		printf("%.2f Hz\t%.1f dB\t%.3f\n", sounding.freqs[i],
+		       sounding.snr[i], sounding.level[i]);
+	if (sofi_select_plan(&sounding, SOUNDING_MIN_SNR, &plan_params))
+		return -1;
+	printf("baud %.2f, frequencies ", plan_params.baud);
+	for (int i = 0; i < (1 << plan_params.symbol_width); i++)
+		printf("%s%.2f", i ? "," : "", plan_params.symbol_freqs[i]);
+	printf("\n");
+	if (plan)
+		return sofi_write_plan(plan, &plan_params);
+	return 0;
+}
+
+static void print_histogram(const char *name, const unsigned long *histogram)
+{
+	fprintf(stderr, "%s (ms):", name);
+	for (int i = 0; i < SOFI_LATENCY_BUCKETS; i++) {
+		if (!histogram[i])
+			continue;
+		if (i == SOFI_LATENCY_BUCKETS - 1)
+			fprintf(stderr, " >=%d:%lu", 1 << (i - 1), histogram[i]);
+		else
+			fprintf(stderr, " <%d:%lu", 1 << i, histogram[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+static void print_callbacks(const char *name,
+			    const struct sofi_callback_stats *stats)
+{
+	fprintf(stderr, "%s callbacks: %lu, %lu underflows, %lu overflows, max load %.0f%%\n",
+		name, stats->calls, stats->underflows, stats->overflows,
+		100.f * stats->max_load);
+	fprintf(stderr, "%s load (%%):", name);
+	for (int i = 0; i < SOFI_LOAD_BUCKETS; i++) {
+		if (!stats->load[i])
+			continue;
+		if (i == SOFI_LOAD_BUCKETS - 1)
+			fprintf(stderr, " >=100:%lu", stats->load[i]);
+		else
+			fprintf(stderr, " <%d:%lu", 10 * (i + 1), stats->load[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+static const char *const stage_names[SOFI_STAGES] = {
+	[SOFI_STAGE_QUEUE] = "Queue",
+	[SOFI_STAGE_GAP] = "Gap",
+	[SOFI_STAGE_OUTPUT] = "Output",
+	[SOFI_STAGE_AIR] = "Air",
+	[SOFI_STAGE_DETECTION] = "Detection",
+	[SOFI_STAGE_DELIVERY] = "Delivery",
+};
+
+/* Print the stages from first to last with their shares of the mean latency. */
+static void print_stages(const struct sofi_stats *stats, int first, int last)
+{
+	double total = 0., mean;
+
+	for (int i = first; i <= last; i++) {
+		if (stats->stages[i].packets)
+			total += stats->stages[i].total / stats->stages[i].packets;
+	}
+	for (int i = first; i <= last; i++) {
+		const struct sofi_stage_stats *s = &stats->stages[i];
+
+		if (!s->packets)
+			continue;
+		mean = s->total / s->packets;
+		fprintf(stderr, "%s stage: mean %.1f ms, max %.1f ms, %.0f%% of the latency\n",
+			stage_names[i], 1000. * mean, 1000. * s->max,
+			total > 0. ? 100. * mean / total : 0.);
+		print_histogram(stage_names[i], s->histogram);
+	}
+}
+
+static void print_stats(const struct sofi_init_parameters *params)
+{
+	struct sofi_stats stats;
+
+	sofi_get_stats(&stats);
+	if (params->sender) {
+		fprintf(stderr, "Sent %lu packets\n", stats.packets_sent);
+		print_histogram("Enqueue to air", stats.enqueue_to_air);
+		print_stages(&stats, SOFI_STAGE_QUEUE, SOFI_STAGE_OUTPUT);
+		print_callbacks("Output", &stats.output);
+	}
+	if (params->receiver) {
+		fprintf(stderr, "Received %lu packets, %lu CRC failures, %lu dropped\n",
+			stats.packets_received, stats.crc_failures,
+			stats.recv_queue_overflows);
+		print_histogram("Air to delivery", stats.air_to_delivery);
+		print_stages(&stats, SOFI_STAGE_AIR, SOFI_STAGE_DELIVERY);
+		print_callbacks("Input", &stats.input);
+		fprintf(stderr, "Capture ring high water %lu of %lu frames\n",
+			stats.capture_high_water, stats.capture_ring_size);
+		fprintf(stderr, "Capture gain %.1f dB, %lu samples clipped, %lu overflows\n",
+			20.f * log10f(stats.capture.gain),
+			stats.capture.clipped, stats.capture.overflows);
+		fprintf(stderr, "Clock offset %+.0f ppm, frequency offset %+.0f ppm\n",
+			stats.clock_offset, stats.frequency_offset);
+	}
+}
+
 static void usage(bool error)
 {
 	fprintf(error ? stderr : stdout,
@@ -83,6 +241,8 @@ static void usage(bool error)
 		"  -S, --sender                       run the sender (enabled by default unless\n"
 		"                                     --receiver is given)\n"
 		"Transmission parameters:\n"
+		"  -a, --adaptive                     adapt the rate to the channel (must be given\n"
+		"                                     on both ends)\n"
 		"  -b, --baud=BAUD                    run at BAUD symbols per second\n"
 		"  -f, --frequencies=FREQ0,FREQ1,...  use the given frequencies for symbols,\n"
 		"                                     with 2, 4, 16, or 256 frequencies for a\n"
@@ -94,6 +254,47 @@ static void usage(bool error)
 		"  -w, --window=WINDOW_FACTOR         use a window of size WINDOW_FACTOR times\n"
 		"                                     the symbol duration time to detect a carrier\n"
 		"                                     wave\n"
+		"  --plan=FILE                        use the baud and frequencies stored in FILE\n"
+		"\n"
+		"Channel sounding:\n"
+		"  --sound=LOW,HIGH                   send (with --sender) or measure (with\n"
+		"                                     --receiver) a probe of the band from LOW to\n"
+		"                                     HIGH Hz instead of transferring data; the\n"
+		"                                     receiver prints the SNR of each tone and\n"
+		"                                     picks a plan, which it stores in the FILE\n"
+		"                                     given with --plan\n"
+		"  --sound-timeout=SECONDS            give up measuring the probe after SECONDS\n"
+		"                                     (no limit by default)\n"
+		"\n"
+		"Audio devices:\n"
+		"  --host-api=NAME                    use the PortAudio host API NAME (e.g., ALSA)\n"
+		"  --input-device=NAME                capture from the device NAME\n"
+		"  --input-channels=N                 capture N channels and combine them\n"
+		"  --combining=METHOD                 combine the input channels with mrc\n"
+		"                                     (maximal-ratio, the default) or selection\n"
+		"  --output-device=NAME               play back on the device NAME\n"
+		"  --output-channels=N                open N output channels\n"
+		"  --channel=CHANNEL                  send on output channel CHANNEL (0 by\n"
+		"                                     default; only channel 0 adapts its rate)\n"
+		"  --device-cache=FILE                remember the device selection in FILE and\n"
+		"                                     reuse it when no device is given\n"
+		"  --frames-per-buffer=FRAMES         run the audio callback every FRAMES frames\n"
+		"  --latency=SECONDS                  suggest a device latency of SECONDS\n"
+		"  --native-rate                      open the devices at their native sample\n"
+		"                                     rate instead of SAMPLE_RATE\n"
+		"  --sample-format=FORMAT             use float32 (the default) or int16 samples;\n"
+		"                                     int16 runs the DSP in fixed point\n"
+		"  --calibrate                        find the smallest stable buffer size, store\n"
+		"                                     it in the device cache if given, and exit\n"
+		"\n"
+		"Debugging:\n"
+		"  --record=FILE                      record the captured and played back\n"
+		"                                     samples to FILE\n"
+		"  --record-limit=BYTES               move the recording to FILE.old and start\n"
+		"                                     a new one when it reaches BYTES (64 MiB by\n"
+		"                                     default)\n"
+		"  --replay=FILE                      receive from the samples recorded in FILE\n"
+		"                                     instead of the input device\n"
 		"\n"
 		"Miscellaneous:\n"
 		"  -k, --keep-open                    keep the connection open even if the sender\n"
@@ -111,6 +312,12 @@ int main(int argc, char** argv)
 	int status = EXIT_SUCCESS;
 	void *retval;
 	struct sofi_init_parameters params = DEFAULT_SOFI_INIT_PARAMS;
+	bool calibrate = false;
+	bool sounding = false;
+	float sound_min = 0.f, sound_max = 0.f;
+	double sound_timeout = INFINITY;
+	const char *plan = NULL;
+	const char *replay = NULL;
 	params.sender = false;
 	params.receiver = false;
 
@@ -120,12 +327,32 @@ int main(int argc, char** argv)
 		static struct option longopts[] = {
 			{"receiver",	no_argument,		NULL,	'R'},
 			{"sender",	no_argument,		NULL,	'S'},
+			{"adaptive",	no_argument,		NULL,	'a'},
 			{"baud",	required_argument,	NULL,	'b'},
 			{"frequencies",	required_argument,	NULL,	'f'},
 			{"gap",		required_argument,	NULL,	'g'},
 			{"max-length",	required_argument,	NULL,	'l'},
 			{"sample-rate",	required_argument,	NULL,	's'},
 			{"window",	required_argument,	NULL,	'w'},
+			{"host-api",	required_argument,	NULL,	OPT_HOST_API},
+			{"input-device",	required_argument,	NULL,	OPT_INPUT_DEVICE},
+			{"output-device",	required_argument,	NULL,	OPT_OUTPUT_DEVICE},
+			{"device-cache",	required_argument,	NULL,	OPT_DEVICE_CACHE},
+			{"frames-per-buffer",	required_argument,	NULL,	OPT_FRAMES_PER_BUFFER},
+			{"latency",	required_argument,	NULL,	OPT_LATENCY},
+			{"calibrate",	no_argument,		NULL,	OPT_CALIBRATE},
+			{"native-rate",	no_argument,		NULL,	OPT_NATIVE_RATE},
+			{"sample-format",	required_argument,	NULL,	OPT_SAMPLE_FORMAT},
+			{"input-channels",	required_argument,	NULL,	OPT_INPUT_CHANNELS},
+			{"combining",	required_argument,	NULL,	OPT_COMBINING},
+			{"output-channels",	required_argument,	NULL,	OPT_OUTPUT_CHANNELS},
+			{"channel",	required_argument,	NULL,	OPT_CHANNEL},
+			{"sound",	required_argument,	NULL,	OPT_SOUND},
+			{"sound-timeout",	required_argument,	NULL,	OPT_SOUND_TIMEOUT},
+			{"plan",	required_argument,	NULL,	OPT_PLAN},
+			{"record",	required_argument,	NULL,	OPT_RECORD},
+			{"record-limit",	required_argument,	NULL,	OPT_RECORD_LIMIT},
+			{"replay",	required_argument,	NULL,	OPT_REPLAY},
 			{"keep-open",	no_argument,		NULL,	'k'},
 			{"debug-level",	required_argument,	NULL,	'd'},
 			{"help",	no_argument,		NULL,	'h'},
@@ -136,7 +363,7 @@ int main(int argc, char** argv)
 		float freq;
 		int i;
 
-		opt = getopt_long(argc, argv, "RSb:f:g:l:s:w:kdh",
+		opt = getopt_long(argc, argv, "RSab:f:g:l:s:w:kdh",
 				  longopts, &longindex);
 		if (opt == -1)
 			break;
@@ -148,6 +375,9 @@ int main(int argc, char** argv)
 		case 'S':
 			params.sender = true;
 			break;
+		case 'a':
+			params.rate_adaptation = true;
+			break;
 		case 'b':
 			params.baud = strtof(optarg, &end);
 			if (*end != '\0')
@@ -226,6 +456,125 @@ int main(int argc, char** argv)
 				usage(true);
 			}
 			break;
+		case OPT_HOST_API:
+			params.host_api = optarg;
+			break;
+		case OPT_INPUT_DEVICE:
+			params.input_device = optarg;
+			break;
+		case OPT_OUTPUT_DEVICE:
+			params.output_device = optarg;
+			break;
+		case OPT_DEVICE_CACHE:
+			params.device_cache = optarg;
+			break;
+		case OPT_FRAMES_PER_BUFFER:
+			params.frames_per_buffer = strtoul(optarg, &end, 10);
+			if (*end != '\0')
+				usage(true);
+			if (params.frames_per_buffer == 0) {
+				fprintf(stderr, "%s: frames per buffer must be positive\n",
+					progname);
+				usage(true);
+			}
+			break;
+		case OPT_LATENCY:
+			params.input_latency = strtod(optarg, &end);
+			if (*end != '\0')
+				usage(true);
+			if (params.input_latency <= 0.) {
+				fprintf(stderr, "%s: latency must be positive\n",
+					progname);
+				usage(true);
+			}
+			params.output_latency = params.input_latency;
+			break;
+		case OPT_CALIBRATE:
+			calibrate = true;
+			break;
+		case OPT_NATIVE_RATE:
+			params.native_rate = true;
+			break;
+		case OPT_SAMPLE_FORMAT:
+			if (strcmp(optarg, "float32") == 0) {
+				params.sample_format = SOFI_SAMPLE_FLOAT32;
+			} else if (strcmp(optarg, "int16") == 0) {
+				params.sample_format = SOFI_SAMPLE_INT16;
+			} else {
+				fprintf(stderr, "%s: unknown sample format %s\n",
+					progname, optarg);
+				usage(true);
+			}
+			break;
+		case OPT_INPUT_CHANNELS:
+			params.input_channels = strtol(optarg, &end, 10);
+			if (*end != '\0')
+				usage(true);
+			if (params.input_channels < 1 || params.input_channels > 8) {
+				fprintf(stderr, "%s: input channels must be between 1 and 8\n",
+					progname);
+				usage(true);
+			}
+			break;
+		case OPT_COMBINING:
+			if (strcmp(optarg, "mrc") == 0) {
+				params.combining = SOFI_COMBINE_MRC;
+			} else if (strcmp(optarg, "selection") == 0) {
+				params.combining = SOFI_COMBINE_SELECTION;
+			} else {
+				fprintf(stderr, "%s: unknown combining %s\n",
+					progname, optarg);
+				usage(true);
+			}
+			break;
+		case OPT_OUTPUT_CHANNELS:
+			params.output_channels = strtol(optarg, &end, 10);
+			if (*end != '\0')
+				usage(true);
+			if (params.output_channels < 1 || params.output_channels > 8) {
+				fprintf(stderr, "%s: output channels must be between 1 and 8\n",
+					progname);
+				usage(true);
+			}
+			break;
+		case OPT_CHANNEL:
+			send_channel = strtol(optarg, &end, 10);
+			if (*end != '\0')
+				usage(true);
+			break;
+		case OPT_SOUND:
+			sound_min = strtof(optarg, &end);
+			if (*end != ',')
+				usage(true);
+			sound_max = strtof(end + 1, &end);
+			if (*end != '\0')
+				usage(true);
+			if (sound_min <= 0.f || sound_max <= sound_min) {
+				fprintf(stderr, "%s: sounding band must be LOW,HIGH with 0 < LOW < HIGH\n",
+					progname);
+				usage(true);
+			}
+			sounding = true;
+			break;
+		case OPT_SOUND_TIMEOUT:
+			sound_timeout = strtod(optarg, &end);
+			if (*end != '\0' || sound_timeout <= 0.)
+				usage(true);
+			break;
+		case OPT_PLAN:
+			plan = optarg;
+			break;
+		case OPT_RECORD:
+			params.record_path = optarg;
+			break;
+		case OPT_RECORD_LIMIT:
+			params.record_limit = strtoul(optarg, &end, 10);
+			if (*end != '\0')
+				usage(true);
+			break;
+		case OPT_REPLAY:
+			replay = optarg;
+			break;
 		case 'k':
 			keep_open = true;
 			break;
@@ -241,13 +590,45 @@ int main(int argc, char** argv)
 			usage(true);
 		}
 	}
+	if (sounding && params.sender == params.receiver) {
+		fprintf(stderr, "%s: --sound needs exactly one of --sender and --receiver\n",
+			progname);
+		usage(true);
+	}
 	if (!params.sender && !params.receiver)
 		params.sender = params.receiver = true;
+	if (replay && params.sender) {
+		fprintf(stderr, "%s: --replay only works with --receiver\n",
+			progname);
+		usage(true);
+	}
+	if (plan && !sounding && sofi_read_plan(plan, &params))
+		return EXIT_FAILURE;
+	if (send_channel < 0 || send_channel >= params.output_channels) {
+		fprintf(stderr, "%s: channel must be less than the number of output channels\n",
+			progname);
+		usage(true);
+	}
+
+	if (calibrate) {
+		unsigned long frames;
+
+		if (sofi_calibrate(&params, &frames))
+			return EXIT_FAILURE;
+		printf("%lu\n", frames);
+		return EXIT_SUCCESS;
+	}
 
 	ret = sofi_init(&params);
 	if (ret)
 		return EXIT_FAILURE;
 
+	if (sounding) {
+		if (sound(&params, sound_min, sound_max, sound_timeout, plan))
+			status = EXIT_FAILURE;
+		goto out;
+	}
+
 	if (params.sender) {
 		ret = pthread_create(&sender_thread, NULL, sender_loop,
 				     (void *)params.receiver);
@@ -259,6 +640,7 @@ int main(int argc, char** argv)
 		}
 	}
 	if (params.receiver) {
+		debug_level = params.debug_level;
 		ret = pthread_create(&receiver_thread, NULL, receiver_loop,
 				     (void *)params.sender);
 		if (ret) {
@@ -272,6 +654,11 @@ int main(int argc, char** argv)
 			goto out;
 		}
 	}
+	if (replay && sofi_replay(replay)) {
+		ret = pthread_cancel(receiver_thread);
+		assert(ret == 0);
+		status = EXIT_FAILURE;
+	}
 
 	if (params.sender) {
 		ret = pthread_join(sender_thread, &retval);
@@ -288,5 +675,7 @@ int main(int argc, char** argv)
 
 out:
 	sofi_destroy();
+	if (params.debug_level)
+		print_stats(&params);
 	return status;
 }